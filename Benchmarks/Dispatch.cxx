@@ -0,0 +1,78 @@
+/***
+ * Copyright (C) Rodolfo Herrera Hernandez. All rights reserved.
+ * Licensed under the MIT license. See LICENSE file in the project root
+ * for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * For related information - https://github.com/codewithrodi/Custos/
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+
+// ! Measures the cost of dispatching one event to its callback, without any
+// ! inotify involved: the std::map used by older versions, the CallbackTable
+// ! used by Custos and the StaticCallbackTable used by StaticCustos.
+// ! Build: g++ -std=c++17 -O2 -pthread -I.. Dispatch.cxx -o Dispatch
+// ! Usage: ./Dispatch [Events = 50000000]
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include "Custos.hxx"
+
+typedef Custos::Event Event;
+
+// ! Written by every handler so the calls can not be optimized away
+static std::uint64_t Sink = 0;
+
+template <class Dispatch>
+static void Measure(const char *Name, const std::vector<Custos::EventInformation> &Events, std::size_t Total, Dispatch &&Run){
+    Sink = 0;
+    auto Begin = std::chrono::steady_clock::now();
+    for(std::size_t Iterator = 0, Position = 0; Iterator < Total; Iterator++){
+        Run(Events[Position]);
+        if(++Position == Events.size())
+            Position = 0;
+    }
+    double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Begin).count();
+    std::cout << Name << ": " << Seconds * 1e9 / Total << " ns/event (checksum " << Sink << ")" << std::endl;
+}
+
+int main(int argc, char* argv[]){
+    std::size_t Total = argc > 1 ? std::stoull(argv[1]) : 50000000;
+    // ! Half of the events have a callback, like a watcher listening to files only
+    std::vector<Custos::EventInformation> Events;
+    for(std::size_t Index = 0; Index < Custos::EventCount; Index++)
+        Events.push_back(Custos::EventInformation{static_cast<Event>(Index), "Directory/File", {}});
+    auto Action = [](const Custos::EventInformation &Information){
+        Sink += Information.Path.native().size();
+    };
+
+    std::map<Event, std::function<void(const Custos::EventInformation &)>> Map;
+    CallbackTable Dynamic;
+    for(auto Type : {Event::FILE_CREATED, Event::FILE_OPENED, Event::FILE_MODIFIED, Event::FILE_CLOSED, Event::FILE_DELETED, Event::FILE_MOVED}){
+        Map[Type] = Action;
+        Dynamic.Add(Type, Action);
+    }
+    StaticCallbackTable Static(
+        Custos::On<Event::FILE_CREATED>(Action),
+        Custos::On<Event::FILE_OPENED>(Action),
+        Custos::On<Event::FILE_MODIFIED>(Action),
+        Custos::On<Event::FILE_CLOSED>(Action),
+        Custos::On<Event::FILE_DELETED>(Action),
+        Custos::On<Event::FILE_MOVED>(Action));
+
+    Measure("std::map (find + operator[])", Events, Total, [&](const Custos::EventInformation &Information){
+        if(Map.find(Information.Type) != Map.end())
+            Map[Information.Type](Information);
+    });
+    Measure("CallbackTable", Events, Total, [&](const Custos::EventInformation &Information){
+        Dynamic.Invoke(Information);
+    });
+    Measure("StaticCallbackTable", Events, Total, [&](const Custos::EventInformation &Information){
+        Static.Invoke(Information);
+    });
+
+    return 0;
+}
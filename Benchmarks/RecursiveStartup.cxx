@@ -0,0 +1,86 @@
+/***
+ * Copyright (C) Rodolfo Herrera Hernandez. All rights reserved.
+ * Licensed under the MIT license. See LICENSE file in the project root
+ * for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * For related information - https://github.com/codewithrodi/Custos/
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+
+// ! Measures how long a recursive watcher takes to cover an existing tree.
+// ! Build: g++ -std=c++17 -O2 -pthread -I.. RecursiveStartup.cxx -o RecursiveStartup
+// ! Usage: ./RecursiveStartup [Fanout = 10] [Depth = 4] [Threads = 0 (one per core)]
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include "Custos.hxx"
+
+// ! Creates <Fanout> directories per level, <Depth> levels deep, below <Path>
+static std::size_t Generate(const std::filesystem::path &Path, unsigned int Fanout, unsigned int Depth){
+    if(Depth == 0)
+        return 0;
+    std::size_t Total = 0;
+    for(unsigned int Iterator = 0; Iterator < Fanout; Iterator++){
+        auto Child = Path / ("Directory" + std::to_string(Iterator));
+        std::filesystem::create_directory(Child);
+        Total += 1 + Generate(Child, Fanout, Depth - 1);
+    }
+    return Total;
+}
+
+int main(int argc, char* argv[]){
+    unsigned int Fanout = argc > 1 ? std::stoul(argv[1]) : 10;
+    unsigned int Depth = argc > 2 ? std::stoul(argv[2]) : 4;
+    unsigned int Threads = argc > 3 ? std::stoul(argv[3]) : 0;
+
+    auto Root = std::filesystem::temp_directory_path() / "CustosRecursiveStartup";
+    std::filesystem::remove_all(Root);
+    std::filesystem::create_directory(Root);
+    std::cout << "Generating tree (fanout " << Fanout << ", depth " << Depth << ")..." << std::endl;
+    std::size_t Directories = Generate(Root, Fanout, Depth) + 1;
+
+    std::size_t Limit = 0;
+    std::ifstream("/proc/sys/fs/inotify/max_user_watches") >> Limit;
+    if(Limit && Directories > Limit)
+        std::cout << "Warning: " << Directories << " directories but max_user_watches is " << Limit << std::endl;
+
+    auto Watcher = Custos(Root.string());
+    Watcher.SetRecursive(true, Threads);
+    std::size_t Watched = 0;
+    Watcher.OnReady([&](std::size_t Directories){
+        Watched = Directories;
+    });
+    // ! A batch callback subscribes to every event, opening and closing directories included
+    std::size_t Queued = 0;
+    Watcher.OnBatch([&](const std::vector<Custos::EventInformation> &Events){
+        Queued += Events.size();
+    });
+
+    try{
+        // ! Open() adds every watch and returns, without waiting for events
+        auto Begin = std::chrono::steady_clock::now();
+        Watcher.Open();
+        double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Begin).count();
+        std::cout << "Directories: " << Directories << std::endl;
+        std::cout << "Watched: " << Watched << std::endl;
+        std::cout << "Time to ready: " << Seconds * 1000.0 << " ms" << std::endl;
+        std::cout << "Dirs/sec: " << static_cast<std::size_t>(Watched / Seconds) << std::endl;
+        // ! Nothing touched the tree, whatever the walk left in the queue (and an
+        // ! overflow, which throws) shows up here
+        Watcher.Poll(0);
+        std::cout << "Events queued by the walk: " << Queued << std::endl;
+        Watcher.Close();
+    }catch(const std::runtime_error& RuntimeError){
+        std::cout << RuntimeError.what() << std::endl;
+        std::filesystem::remove_all(Root);
+        return 1;
+    }
+
+    std::filesystem::remove_all(Root);
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+/***
+ * Copyright (C) Rodolfo Herrera Hernandez. All rights reserved.
+ * Licensed under the MIT license. See LICENSE file in the project root
+ * for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * For related information - https://github.com/codewithrodi/Custos/
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+
+// ! Measures how many events per second a watcher sustains under create, modify and
+// ! delete storms, and how long each event takes from the system call to its callback.
+// ! Build: g++ -std=c++17 -O2 -pthread -I.. Throughput.cxx -o Throughput
+// ! Usage: ./Throughput [Files = 10000] [BufferSize = default]
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include "Custos.hxx"
+
+typedef std::chrono::steady_clock Clock;
+
+// ! Phases of the storm, every file goes through all of them
+enum Phase{ CREATE, MODIFY, DELETE, PHASES };
+
+static void Percentiles(const char *Name, std::vector<double> &Latencies){
+    if(Latencies.empty())
+        return;
+    std::sort(Latencies.begin(), Latencies.end());
+    auto At = [&](double Fraction){
+        return Latencies[std::min(Latencies.size() - 1, static_cast<std::size_t>(Fraction * Latencies.size()))];
+    };
+    std::cout << Name << " latency (us): p50 " << At(0.5) << ", p99 " << At(0.99) << ", max " << Latencies.back() << std::endl;
+}
+
+int main(int argc, char* argv[]){
+    std::size_t Files = argc > 1 ? std::stoul(argv[1]) : 10000;
+    std::size_t BufferSize = argc > 2 ? std::stoul(argv[2]) : 0;
+
+    auto Root = std::filesystem::temp_directory_path() / "CustosThroughput";
+    std::filesystem::remove_all(Root);
+    std::filesystem::create_directory(Root);
+
+    // ! When each operation was issued, written by the generator and read by the callbacks
+    std::unique_ptr<std::atomic<Clock::rep>[]> Issued[PHASES];
+    for(auto &Stamps : Issued)
+        Stamps.reset(new std::atomic<Clock::rep>[Files]());
+    std::vector<double> Latencies[PHASES];
+    std::atomic<std::size_t> Received{0};
+
+    auto Measure = [&](Phase Phase){
+        return [&, Phase](const Custos::EventInformation &Information){
+            auto Now = Clock::now().time_since_epoch().count();
+            auto Index = std::stoul(Information.Path.filename().string().substr(4));
+            if(Index < Files)
+                Latencies[Phase].push_back(std::chrono::duration<double, std::micro>(
+                    Clock::duration(Now - Issued[Phase][Index].load(std::memory_order_relaxed))).count());
+            Received.fetch_add(1, std::memory_order_relaxed);
+        };
+    };
+
+    auto Watcher = Custos(Root.string());
+    // ! Overflows are counted instead of aborting the run
+    Watcher.SetRecovery(true);
+    if(BufferSize)
+        Watcher.SetBufferSize(BufferSize);
+    Watcher.On(Custos::Event::FILE_CREATED, Measure(CREATE));
+    Watcher.On(Custos::Event::FILE_MODIFIED, Measure(MODIFY));
+    Watcher.On(Custos::Event::FILE_DELETED, Measure(DELETE));
+
+    try{
+        Watcher.Open();
+    }catch(const std::runtime_error& RuntimeError){
+        std::cout << RuntimeError.what() << std::endl;
+        std::filesystem::remove_all(Root);
+        return 1;
+    }
+    std::thread Reader([&]{
+        while(Watcher.Poll());
+    });
+
+    std::cout << "Storming " << Files << " files..." << std::endl;
+    auto Begin = Clock::now();
+    for(int Current = CREATE; Current < PHASES; Current++){
+        for(std::size_t Index = 0; Index < Files; Index++){
+            auto Path = (Root / ("File" + std::to_string(Index))).string();
+            Issued[Current][Index].store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+            if(Current == CREATE){
+                close(open(Path.c_str(), O_CREAT | O_WRONLY, 0644));
+            }else if(Current == MODIFY){
+                int File = open(Path.c_str(), O_WRONLY | O_APPEND);
+                if(write(File, "x", 1) < 0)
+                    std::cout << "Write failed: " << strerror(errno) << std::endl;
+                close(File);
+            }else{
+                unlink(Path.c_str());
+            }
+        }
+    }
+
+    // ! Wait for every event, or until nothing new arrives for a second
+    std::size_t Expected = Files * PHASES, Last = 0;
+    auto Idle = Clock::now();
+    while(Received.load() < Expected && Clock::now() - Idle < std::chrono::seconds(1)){
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if(Received.load() != Last){
+            Last = Received.load();
+            Idle = Clock::now();
+        }
+    }
+    double Seconds = std::chrono::duration<double>(Clock::now() - Begin).count();
+    auto Metrics = Watcher.GetMetrics();
+    Watcher.Stop();
+    Reader.join();
+    Watcher.Close();
+
+    std::cout << "Events: " << Received.load() << " of " << Expected << std::endl;
+    std::cout << "Events/sec: " << static_cast<std::size_t>(Received.load() / Seconds) << std::endl;
+    Percentiles("Create", Latencies[CREATE]);
+    Percentiles("Modify", Latencies[MODIFY]);
+    Percentiles("Delete", Latencies[DELETE]);
+    std::cout << "Reads: " << Metrics.Reads << std::endl;
+    std::cout << "Events/read: " << Metrics.EventsPerRead() << std::endl;
+    std::cout << "Bytes/read: " << Metrics.BytesPerRead() << std::endl;
+    std::cout << "Full buffers: " << Metrics.BufferFull << std::endl;
+    std::cout << "Overflows: " << Metrics.Overflows << std::endl;
+    std::cout << "Callback time (us, log2 buckets):";
+    for(auto Count : Metrics.CallbackLatency)
+        std::cout << ' ' << Count;
+    std::cout << std::endl;
+
+    std::filesystem::remove_all(Root);
+
+    return 0;
+}
@@ -11,17 +11,37 @@
  ****/
 
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
-#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #ifdef __linux__
+    #include <dirent.h>
     #include <errno.h>
+    #include <fcntl.h>
+    #include <fnmatch.h>
     #include <limits.h>
-    #include <signal.h>
+    #include <poll.h>
+    #include <sys/eventfd.h>
     #include <sys/inotify.h>
+    #include <sys/stat.h>
     #include <sys/types.h>
     #include <unistd.h>
     // ! Max number of events to process at one go
@@ -32,67 +52,756 @@
     #define EVENT_SIZE (sizeof(struct inotify_event))
     // ! Buffer to store the data of events
     #define EVENT_BUFFER_LENGTH (MAX_EVENTS * (EVENT_SIZE + LENGTH_NAME))
-    #define WATCH_FLAGS (IN_CREATE | IN_MODIFY | IN_DELETE | IN_OPEN | IN_CLOSE)
-    // ! Keep going while Run == true, or, in other words, unitl user hits ctrl-c
-    static bool Run = true;
-    void SigCallback(int Sig){
-        Run = false;
-    }
+    #define WATCH_FLAGS (IN_CREATE | IN_MODIFY | IN_DELETE | IN_OPEN | IN_CLOSE | IN_MOVE)
 
+    // ! Append-only storage for path strings. Memory is handed out from fixed
+    // ! size chunks that are never moved, so the views returned by Intern stay
+    // ! valid until the arena is cleared.
+    class PathArena{
+        static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+        std::vector<std::unique_ptr<char[]>> Chunks;
+        std::size_t Offset = CHUNK_SIZE;
+        std::size_t Used = 0;
+
+        public:
+            // ! Copy the concatenation of <Parts> into the arena, returns a view of it
+            std::string_view Intern(std::initializer_list<std::string_view> Parts){
+                std::size_t Length = 0;
+                for(auto &Part : Parts)
+                    Length += Part.size();
+                char *Destination;
+                if(Length > CHUNK_SIZE / 4){
+                    // ! Big strings get a chunk of their own, inserted behind the current
+                    // ! one so the remaining space of the current chunk is not wasted
+                    auto Chunk = std::make_unique<char[]>(Length);
+                    Destination = Chunk.get();
+                    Chunks.insert(Chunks.empty() ? Chunks.end() : Chunks.end() - 1, std::move(Chunk));
+                }else{
+                    if(Offset + Length > CHUNK_SIZE){
+                        Chunks.push_back(std::make_unique<char[]>(CHUNK_SIZE));
+                        Offset = 0;
+                    }
+                    Destination = Chunks.back().get() + Offset;
+                    Offset += Length;
+                }
+                std::size_t Position = 0;
+                for(auto &Part : Parts){
+                    std::memcpy(Destination + Position, Part.data(), Part.size());
+                    Position += Part.size();
+                }
+                Used += Length;
+                return std::string_view(Destination, Length);
+            }
+
+            std::size_t Size() const{
+                return Used;
+            }
+
+            void Clear(){
+                Chunks.clear();
+                Offset = CHUNK_SIZE;
+                Used = 0;
+            }
+    };
+
+    // ! Watch descriptor table. The kernel never reuses a WD, so they are mapped
+    // ! to dense slots of a vector, and slots freed by erased watches are reused:
+    // ! its size follows the number of live watches, not how many were ever
+    // ! added. Every entry keeps its full path precomputed in a PathArena, and a
+    // ! hash index maps (parent WD, name) back to the WD for IN_DELETE events,
+    // ! neither lookup allocates. A renamed directory only updates its own entry,
+    // ! the paths below it are rebuilt the next time they are asked for.
     class Watch{
         struct WDElement{
+            // ! -1 when the slot is free
+            int WD = -1;
+            int PD = -1;
+            // ! Full path of the directory, <Name> is a view of its last component
+            std::string_view Path;
+            std::string_view Name;
+            // ! Changes every time <Path> does
+            std::uint64_t Generation = 0;
+            // ! Generation of the parent when <Path> was built
+            std::uint64_t ParentGeneration = 0;
+            // ! Value of Renames when <Path> was last known to be up to date
+            std::uint64_t Checked = 0;
+        };
+        struct Key{
             int PD;
-            std::string Name;
-            bool operator()(const WDElement &Left, const WDElement &Right) const{
-                return Left.PD < Right.PD ? (true) : 
-                    (Left.PD == Right.PD && Left.Name < Right.Name ? true : false);
+            std::string_view Name;
+            bool operator==(const Key &Other) const{
+                return PD == Other.PD && Name == Other.Name;
+            }
+        };
+        struct KeyHash{
+            std::size_t operator()(const Key &Element) const{
+                return std::hash<std::string_view>()(Element.Name) ^ (std::hash<int>()(Element.PD) * 0x9e3779b97f4a7c15ULL);
             }
         };
-        std::map<int, WDElement> Watch;
-        std::map<WDElement, int, WDElement> RightWatch;
+        std::vector<WDElement> Watch;
+        // ! WD to its slot in <Watch>, and the slots free to be reused
+        std::unordered_map<int, int> Slots;
+        std::vector<int> Free;
+        std::unordered_map<Key, int, KeyHash> RightWatch;
+        PathArena Arena;
+        std::size_t Count = 0;
+        // ! Bytes of the arena that belong to erased entries
+        std::size_t Wasted = 0;
+        std::uint64_t Generations = 0;
+        // ! Bumped by every rename, entries checked since then skip the walk up
+        std::uint64_t Renames = 0;
 
         public:
             // ! Insert event information, used to create new watch, into Watch object
-            void Insert(int PD, const std::string &Name, int WD){
-                WDElement Element = {PD, Name};
-                Watch[WD] = Element;
-                RightWatch[Element] = WD;
+            void Insert(int PD, std::string_view Name, int WD){
+                if(WD < 0)
+                    return;
+                // ! Adding a watch twice on the same directory returns the same WD,
+                // ! its path may differ so the entries below it are checked again
+                int Index = Slot(WD);
+                if(Index >= 0){
+                    Release(Index);
+                    Renames++;
+                }
+                if(Free.empty()){
+                    Index = Watch.size();
+                    Watch.emplace_back();
+                }else{
+                    Index = Free.back();
+                    Free.pop_back();
+                }
+                Watch[Index].WD = WD;
+                Slots[WD] = Index;
+                Link(Index, PD, Name);
+                Count++;
+            }
+
+            // ! Move the watch <WD> to <Name> inside <PD>, after a rename inside the
+            // ! watched tree. Only this entry is touched, the watches below it keep
+            // ! their WDs and their paths are rebuilt lazily by Get().
+            void Rename(int WD, int PD, std::string_view Name){
+                int Index = Slot(WD);
+                if(Index < 0)
+                    return;
+                WDElement &Element = Watch[Index];
+                auto Iterator = RightWatch.find(Key{Element.PD, Element.Name});
+                if(Iterator != RightWatch.end() && Iterator->second == WD)
+                    RightWatch.erase(Iterator);
+                // ! An empty directory replaced by the rename, the kernel drops its watch
+                int Replaced = Slot(Get(PD, Name));
+                if(Replaced >= 0 && Replaced != Index)
+                    Release(Replaced);
+                Wasted += Element.Path.size();
+                Renames++;
+                Link(Index, PD, Name);
+            }
+
+            // ! Erase <WD> and every watch below it, returns their WDs so they can be
+            // ! removed from inotify: the kernel keeps watching a directory that was
+            // ! moved out of the tree. Walks the whole table once.
+            std::vector<int> Detach(int WD){
+                std::vector<int> Result;
+                int Index = Slot(WD);
+                if(Index < 0)
+                    return Result;
+                // ! By slot, 0 unknown, 1 below <WD>, 2 elsewhere
+                std::vector<char> Below(Watch.size(), 0);
+                std::vector<int> Chain, Released;
+                Below[Index] = 1;
+                for(std::size_t Current = 0; Current < Watch.size(); Current++){
+                    if(Watch[Current].WD < 0)
+                        continue;
+                    int Walk = Current;
+                    while(Walk >= 0 && Below[Walk] == 0){
+                        Chain.push_back(Walk);
+                        Walk = Slot(Watch[Walk].PD);
+                    }
+                    char Position = Walk >= 0 ? Below[Walk] : 2;
+                    for(auto Element : Chain)
+                        Below[Element] = Position;
+                    Chain.clear();
+                    if(Position == 1)
+                        Released.push_back(Current);
+                }
+                for(auto Element : Released){
+                    Result.push_back(Watch[Element].WD);
+                    Release(Element);
+                }
+                return Result;
             }
 
             // ! Erase watch specified by PD(Parent watch descriptor) and name from
             // ! watch list, returns full name(For display etc), and WD, which is required
-            // ! for <inotify_rm_watch>.
-            std::string Erase(int PD, const std::string &Name, int *WD){
-                WDElement ParentElement = {PD, Name};
-                *WD = RightWatch[ParentElement];
-                RightWatch.erase(ParentElement);
-                const WDElement &Element = Watch[*WD];
-                std::string Directory = Element.Name;
-                Watch.erase(*WD);
+            // ! for <inotify_rm_watch>. The returned view is valid until Compact().
+            std::string_view Erase(int PD, std::string_view Name, int *WD){
+                *WD = Get(PD, Name);
+                int Index = Slot(*WD);
+                if(Index < 0)
+                    return std::string_view();
+                Refresh(Index);
+                std::string_view Directory = Watch[Index].Path;
+                Release(Index);
                 return Directory;
             }
 
-            // ! Given a watch descriptor, return the full directory name as string.
-            // ! Recurses up parent WDs to assemble name, an idea borrowed from Windows change journals
-            std::string Get(int WD){
-                const WDElement &Element = Watch[WD];
-                return Element.PD == -1 ? Element.Name : this->Get(Element.PD) + "/" + Element.Name;
+            // ! Erase the watch <WD>, used when the kernel reports it was removed
+            void Erase(int WD){
+                int Index = Slot(WD);
+                if(Index >= 0)
+                    Release(Index);
+            }
+
+            // ! Given a watch descriptor, return the full directory name, the view is
+            // ! valid until Compact(). Empty when <WD> is not watched.
+            std::string_view Get(int WD){
+                int Index = Slot(WD);
+                if(Index < 0)
+                    return std::string_view();
+                Refresh(Index);
+                return Watch[Index].Path;
+            }
+
+            // ! Watch descriptor of the directory containing <WD>, -1 for roots
+            int Parent(int WD) const{
+                int Index = Slot(WD);
+                return Index < 0 ? -1 : Watch[Index].PD;
             }
 
             // ! Given a parameter WD and Name (Provided in IN_DELETE events), return the watch
             // ! descriptor, main purpose is to help remove directories from watch list.
-            int Get(int PD, std::string Name){
-                WDElement Element = {PD, Name};
-                return RightWatch[Element];
+            // ! Returns -1 when the directory is not watched.
+            int Get(int PD, std::string_view Name) const{
+                auto Iterator = RightWatch.find(Key{PD, Name});
+                return Iterator == RightWatch.end() ? -1 : Iterator->second;
+            }
+
+            std::size_t Size() const{
+                return Count;
+            }
+
+            // ! Erased entries leave their paths behind in the arena, once they take
+            // ! more room than the live ones the arena is rebuilt. Must not be called
+            // ! while views returned by Get/Erase are still in use.
+            void Compact(){
+                if(Wasted < 1024 * 1024 || Wasted < Arena.Size() / 2)
+                    return;
+                PathArena Fresh;
+                RightWatch.clear();
+                for(auto &Element : Watch){
+                    if(Element.WD < 0)
+                        continue;
+                    std::size_t NameLength = Element.Name.size();
+                    Element.Path = Fresh.Intern({Element.Path});
+                    Element.Name = Element.Path.substr(Element.Path.size() - NameLength);
+                    RightWatch[Key{Element.PD, Element.Name}] = Element.WD;
+                }
+                Arena = std::move(Fresh);
+                Wasted = 0;
             }
 
             void Stats(){
-                std::cout << "Number of watches = " << Watch.size() << " & reverse watches = " << RightWatch.size() << std::endl;
+                std::cout << "Number of watches = " << Count << " & reverse watches = " << RightWatch.size() << std::endl;
+            }
+
+        private:
+            // ! Slot of <WD> in <Watch>, -1 when it is not watched
+            int Slot(int WD) const{
+                if(WD < 0)
+                    return -1;
+                auto Iterator = Slots.find(WD);
+                return Iterator == Slots.end() ? -1 : Iterator->second;
+            }
+
+            // ! Place the entry at <Index> as <Name> inside <PD>, or as a root
+            void Link(int Index, int PD, std::string_view Name){
+                WDElement &Element = Watch[Index];
+                int ParentIndex = PD == Element.WD ? -1 : Slot(PD);
+                bool IsRoot = ParentIndex < 0;
+                if(!IsRoot)
+                    Refresh(ParentIndex);
+                Element.PD = IsRoot ? -1 : PD;
+                Element.Path = IsRoot ? Arena.Intern({Name}) : Arena.Intern({Watch[ParentIndex].Path, "/", Name});
+                Element.Name = Element.Path.substr(Element.Path.size() - Name.size());
+                Element.Generation = ++Generations;
+                Element.ParentGeneration = IsRoot ? 0 : Watch[ParentIndex].Generation;
+                Element.Checked = Renames;
+                RightWatch[Key{Element.PD, Element.Name}] = Element.WD;
+            }
+
+            // ! Rebuild the path of the entry at <Index> if one of its parents was
+            // ! renamed since it was built. Free when nothing was renamed since the
+            // ! last check.
+            void Refresh(int Index){
+                WDElement &Element = Watch[Index];
+                if(Element.Checked == Renames)
+                    return;
+                Element.Checked = Renames;
+                int ParentIndex = Slot(Element.PD);
+                if(ParentIndex < 0)
+                    return;
+                Refresh(ParentIndex);
+                const WDElement &Parent = Watch[ParentIndex];
+                if(Element.ParentGeneration == Parent.Generation)
+                    return;
+                // ! The old bytes stay in the arena, the hash index still points at them
+                std::string_view Name = Element.Name;
+                Wasted += Element.Path.size();
+                Element.Path = Arena.Intern({Parent.Path, "/", Name});
+                Element.Name = Element.Path.substr(Element.Path.size() - Name.size());
+                Element.Generation = ++Generations;
+                Element.ParentGeneration = Parent.Generation;
+            }
+
+            void Release(int Index){
+                WDElement &Element = Watch[Index];
+                auto Iterator = RightWatch.find(Key{Element.PD, Element.Name});
+                if(Iterator != RightWatch.end() && Iterator->second == Element.WD)
+                    RightWatch.erase(Iterator);
+                Wasted += Element.Path.size();
+                Slots.erase(Element.WD);
+                Element = WDElement();
+                Free.push_back(Index);
+                Count--;
+            }
+    };
+
+    // ! Metadata of the entries of every watched directory, kept in sync with
+    // ! the events received. When the kernel queue overflows, the directories
+    // ! are listed again and compared against it to find out what was missed.
+    class Snapshot{
+        public:
+            struct Entry{
+                ino_t Inode;
+                struct timespec Modified;
+                off_t Size;
+                bool IsDirectory;
+            };
+            struct Directory{
+                ino_t Inode = 0;
+                struct timespec Modified = {0, 0};
+                // ! Received events since the last recovery
+                bool Active = false;
+                std::unordered_map<std::string, Entry> Entries;
+            };
+
+            // ! Fill <Element> with the metadata of <Name>, relative to <DirectoryFD>
+            static bool Stat(int DirectoryFD, const char *Name, Entry &Element){
+                struct stat Status;
+                if(fstatat(DirectoryFD, Name, &Status, AT_SYMLINK_NOFOLLOW) != 0)
+                    return false;
+                Element = Entry{Status.st_ino, Status.st_mtim, Status.st_size, S_ISDIR(Status.st_mode)};
+                return true;
+            }
+
+            static bool Changed(const struct timespec &Left, const struct timespec &Right){
+                return Left.tv_sec != Right.tv_sec || Left.tv_nsec != Right.tv_nsec;
+            }
+
+            void Set(int WD, Directory &&Element){
+                Directories[WD] = std::move(Element);
+            }
+
+            Directory *Find(int WD){
+                auto Iterator = Directories.find(WD);
+                return Iterator == Directories.end() ? nullptr : &Iterator->second;
+            }
+
+            void Erase(int WD){
+                Directories.erase(WD);
+            }
+
+            // ! Record the current metadata of <Name>. If it is already gone, the entry
+            // ! is kept (or added empty) so that a recovery reports it as deleted,
+            // ! its deletion event may be the one that gets lost.
+            void Update(int WD, const std::string &Path, std::string_view Name, bool IsDirectory){
+                Directory *Element = Find(WD);
+                if(!Element)
+                    return;
+                Element->Active = true;
+                Entry Status;
+                if(Stat(AT_FDCWD, Path.c_str(), Status))
+                    Element->Entries[std::string(Name)] = Status;
+                else
+                    Element->Entries.try_emplace(std::string(Name), Entry{0, {0, 0}, 0, IsDirectory});
+            }
+
+            void Remove(int WD, std::string_view Name){
+                Directory *Element = Find(WD);
+                if(!Element)
+                    return;
+                Element->Active = true;
+                Element->Entries.erase(std::string(Name));
+            }
+
+            std::unordered_map<int, Directory> &All(){
+                return Directories;
+            }
+
+        private:
+            std::unordered_map<int, Directory> Directories;
+    };
+
+    // ! Name patterns deciding which entries are watched and reported. Patterns
+    // ! are globs (see fnmatch) matched against the name of the entry, not its
+    // ! path, a trailing '/' makes a pattern only match directories, for example
+    // ! ".git/", "node_modules/" or "*.o".
+    class Filter{
+        public:
+            void Add(const std::string &Pattern, bool Include){
+                Rule Element;
+                Element.DirectoryOnly = !Pattern.empty() && Pattern.back() == '/';
+                Element.Glob = Element.DirectoryOnly ? Pattern.substr(0, Pattern.size() - 1) : Pattern;
+                // ! Most patterns are plain names or "*.extension", compare those directly
+                bool Wildcards = Element.Glob.find_first_of("*?[\\") != std::string::npos;
+                bool Suffix = Element.Glob.size() > 1 && Element.Glob[0] == '*' &&
+                    Element.Glob.find_first_of("*?[\\", 1) == std::string::npos;
+                Element.Kind = !Wildcards ? Rule::LITERAL : (Suffix ? Rule::SUFFIX : Rule::GLOB);
+                if(Element.Kind == Rule::SUFFIX)
+                    Element.Glob.erase(0, 1);
+                if(!Include)
+                    Excludes.push_back(Element);
+                else if(Element.DirectoryOnly)
+                    DirectoryIncludes.push_back(Element);
+                else
+                    FileIncludes.push_back(Element);
+            }
+
+            // ! Excluded directories are never watched, excluded entries never reported
+            bool Excluded(const char *Name, bool IsDirectory) const{
+                return Matches(Excludes, Name, IsDirectory);
+            }
+
+            // ! When include patterns exist for files (or directories), only the
+            // ! files (or directories) matching one of them are reported
+            bool Included(const char *Name, bool IsDirectory) const{
+                const std::vector<Rule> &Rules = IsDirectory ? DirectoryIncludes : FileIncludes;
+                return Rules.empty() || Matches(Rules, Name, IsDirectory);
+            }
+
+        private:
+            struct Rule{
+                enum{ LITERAL, SUFFIX, GLOB } Kind;
+                bool DirectoryOnly;
+                std::string Glob;
+            };
+            std::vector<Rule> Excludes;
+            std::vector<Rule> FileIncludes;
+            std::vector<Rule> DirectoryIncludes;
+
+            static bool Matches(const std::vector<Rule> &Rules, const char *Name, bool IsDirectory){
+                std::size_t Length = 0;
+                for(auto &Element : Rules){
+                    if(Element.DirectoryOnly && !IsDirectory)
+                        continue;
+                    if(Element.Kind == Rule::LITERAL){
+                        if(Element.Glob == Name)
+                            return true;
+                    }else if(Element.Kind == Rule::SUFFIX){
+                        // ! Like fnmatch with FNM_PERIOD the leading '*' never matches a leading '.'
+                        if(Name[0] == '.')
+                            continue;
+                        if(!Length)
+                            Length = std::strlen(Name);
+                        if(Length >= Element.Glob.size() && std::memcmp(Name + Length - Element.Glob.size(), Element.Glob.data(), Element.Glob.size()) == 0)
+                            return true;
+                    }else if(fnmatch(Element.Glob.c_str(), Name, FNM_PERIOD) == 0){
+                        return true;
+                    }
+                }
+                return false;
+            }
+    };
+
+    // ! Walks existing directory trees with a pool of threads, adding an inotify
+    // ! watch to every subdirectory found. Each worker lists one directory at a
+    // ! time and pushes the subdirectories it discovers back into a shared stack,
+    // ! so wide and deep trees are spread evenly across the pool. The watch of a
+    // ! directory is always added before it is listed, that way entries created
+    // ! while the walk is in progress still produce an IN_CREATE event. The
+    // ! scanner can also record a Snapshot of each directory it lists, and list
+    // ! the given directories without descending into them. Entries excluded by
+    // ! the Filter are skipped entirely.
+    class DirectoryScanner{
+        public:
+            // ! A watch added by the scanner, ready to be inserted into a Watch object
+            struct Entry{
+                int PD;
+                std::string Name;
+                int WD;
+                // ! Distance from the root the walk started at
+                unsigned int Depth;
+            };
+            // ! Metadata of the entries of a listed directory, see Scan()
+            typedef std::pair<int, Snapshot::Directory> Listing;
+
+            DirectoryScanner(int FD, uint32_t Flags, unsigned int Threads, bool Descend = true, const Filter *Filters = nullptr) :
+                FD(FD), Flags(Flags), Threads(Threads), Descend(Descend), Filters(Filters){
+                if(this->Threads == 0)
+                    this->Threads = std::thread::hardware_concurrency();
+                if(this->Threads == 0)
+                    this->Threads = 1;
+            }
+
+            // ! Listing a directory opens and closes it, which queues an event on its
+            // ! own watch and on its parent's. Watches touched by a walk carry this
+            // ! mask until the walk is over, then they get <Flags>.
+            static uint32_t Quiet(uint32_t Flags){
+                return Flags & ~(IN_OPEN | IN_CLOSE);
+            }
+
+            // ! Scan every subdirectory below the given roots, <Roots> are pairs of
+            // ! already watched directories (WD, Path), which should be watched with
+            // ! Quiet(Flags) (and so their parents) while it runs. If the kernel refuses
+            // ! to add more watches the walk stops, see LimitReached(), any other
+            // ! failure (directory removed during the walk, permission denied...) just
+            // ! skips that directory. Entries are returned
+            // ! parents first, so they can be inserted into a Watch object in order.
+            // ! When <Listings> is given, every entry of every listed directory is
+            // ! stat'ed and recorded there, roots included.
+            std::vector<Entry> Scan(const std::vector<std::pair<int, std::string>> &Roots, std::vector<Listing> *Listings = nullptr){
+                std::vector<Entry> Result;
+                Stack.clear();
+                for(auto &Root : Roots)
+                    if(Root.first >= 0)
+                        Stack.push_back(Job{Root.first, Root.second, 0});
+                Pending = Stack.size();
+                Error = 0;
+                Capture = Listings != nullptr;
+                if(Pending == 0)
+                    return Result;
+                std::vector<std::vector<Entry>> Found(Threads);
+                std::vector<std::vector<Listing>> Listed(Threads);
+                std::vector<std::vector<std::string>> Added(Threads);
+                if(Threads == 1){
+                    Work(Found[0], Listed[0], Added[0]);
+                }else{
+                    std::vector<std::thread> Pool;
+                    Pool.reserve(Threads);
+                    for(unsigned int Iterator = 0; Iterator < Threads; Iterator++)
+                        Pool.emplace_back(&DirectoryScanner::Work, this, std::ref(Found[Iterator]),
+                            std::ref(Listed[Iterator]), std::ref(Added[Iterator]));
+                    for(auto &Thread : Pool)
+                        Thread.join();
+                }
+                if(Quiet(Flags) != Flags){
+                    for(auto &Root : Roots)
+                        if(Root.first >= 0)
+                            inotify_add_watch(FD, Root.second.c_str(), Flags);
+                    // ! After an error the workers left without widening their watches
+                    if(Error != 0)
+                        for(auto &Paths : Added)
+                            for(auto &Path : Paths)
+                                inotify_add_watch(FD, Path.c_str(), Flags | IN_ONLYDIR | IN_DONT_FOLLOW);
+                }
+                if(Capture)
+                    for(auto &Element : Listed)
+                        for(auto &Directory : Element)
+                            Listings->push_back(std::move(Directory));
+                // ! Workers interleave levels of the tree, bucket the entries by depth
+                std::vector<std::size_t> Offsets;
+                std::size_t Total = 0;
+                for(auto &Entries : Found){
+                    Total += Entries.size();
+                    for(auto &Element : Entries){
+                        if(Element.Depth >= Offsets.size())
+                            Offsets.resize(Element.Depth + 1, 0);
+                        Offsets[Element.Depth]++;
+                    }
+                }
+                std::size_t Position = 0;
+                for(auto &Offset : Offsets){
+                    std::size_t Count = Offset;
+                    Offset = Position;
+                    Position += Count;
+                }
+                Result.resize(Total);
+                for(auto &Entries : Found)
+                    for(auto &Element : Entries)
+                        Result[Offsets[Element.Depth]++] = std::move(Element);
+                return Result;
+            }
+
+            // ! Whether the last Scan() stopped because the kernel refused to add
+            // ! more watches, see /proc/sys/fs/inotify/max_user_watches
+            bool LimitReached() const{
+                return Error == ENOSPC;
+            }
+
+        private:
+            struct Job{
+                int WD;
+                std::string Path;
+                unsigned int Depth;
+            };
+
+            int FD;
+            uint32_t Flags;
+            unsigned int Threads;
+            bool Descend;
+            const Filter *Filters;
+            bool Capture = false;
+            std::mutex Mutex;
+            std::condition_variable Condition;
+            std::vector<Job> Stack;
+            // ! Jobs queued plus jobs being processed, the walk ends when it hits zero
+            std::size_t Pending = 0;
+            int Error = 0;
+
+            // ! <Added> receives the paths of the watches added by this thread, they
+            // ! are widened once nothing is listed anymore
+            void Work(std::vector<Entry> &Found, std::vector<Listing> &Listed, std::vector<std::string> &Added){
+                std::vector<Job> Discovered;
+                bool Finished = false;
+                for(;;){
+                    Job Current;
+                    {
+                        std::unique_lock<std::mutex> Lock(Mutex);
+                        Condition.wait(Lock, [this]{ return !Stack.empty() || Pending == 0; });
+                        // ! Once the watch limit is hit there is no point in listing more directories
+                        if(Error != 0){
+                            Pending -= Stack.size();
+                            Stack.clear();
+                        }
+                        if(Stack.empty()){
+                            // ! Without an error the stack only runs dry once every job is done
+                            Finished = Error == 0;
+                            break;
+                        }
+                        Current = std::move(Stack.back());
+                        Stack.pop_back();
+                    }
+                    Discovered.clear();
+                    List(Current, Found, Discovered, Listed);
+                    if(Quiet(Flags) != Flags)
+                        for(auto &Element : Discovered)
+                            Added.push_back(Element.Path);
+                    // ! Publish all subdirectories found in one go, instead of taking
+                    // ! the lock once per entry
+                    std::lock_guard<std::mutex> Lock(Mutex);
+                    if(Error != 0)
+                        Discovered.clear();
+                    for(auto &Element : Discovered)
+                        Stack.push_back(std::move(Element));
+                    Pending += Discovered.size();
+                    Pending--;
+                    if(Pending == 0 || Discovered.size() > 1)
+                        Condition.notify_all();
+                    else if(Discovered.size() == 1)
+                        Condition.notify_one();
+                }
+                if(Finished)
+                    for(auto &Path : Added)
+                        inotify_add_watch(FD, Path.c_str(), Flags | IN_ONLYDIR | IN_DONT_FOLLOW);
+            }
+
+            void List(const Job &Current, std::vector<Entry> &Found, std::vector<Job> &Discovered, std::vector<Listing> &Listed){
+                int DirectoryFD = open(Current.Path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if(DirectoryFD < 0)
+                    return;
+                DIR *Directory = fdopendir(DirectoryFD);
+                if(!Directory){
+                    close(DirectoryFD);
+                    return;
+                }
+                Snapshot::Directory *State = nullptr;
+                struct stat Status;
+                if(Capture && fstat(DirectoryFD, &Status) == 0){
+                    Listed.emplace_back(Current.WD, Snapshot::Directory());
+                    State = &Listed.back().second;
+                    State->Inode = Status.st_ino;
+                    State->Modified = Status.st_mtim;
+                }
+                std::string Path;
+                while(struct dirent *Element = readdir(Directory)){
+                    const char *Name = Element->d_name;
+                    if(Name[0] == '.' && (Name[1] == '\0' || (Name[1] == '.' && Name[2] == '\0')))
+                        continue;
+                    bool IsDirectory = Element->d_type == DT_DIR;
+                    bool Known = Element->d_type != DT_UNKNOWN;
+                    if(Known && Filters && Filters->Excluded(Name, IsDirectory))
+                        continue;
+                    if(State || !Known){
+                        // ! Some filesystems do not fill d_type, fall back to a stat
+                        Snapshot::Entry Metadata;
+                        if(!Snapshot::Stat(DirectoryFD, Name, Metadata))
+                            continue;
+                        IsDirectory = Metadata.IsDirectory;
+                        if(!Known && Filters && Filters->Excluded(Name, IsDirectory))
+                            continue;
+                        if(State)
+                            State->Entries.emplace(Name, Metadata);
+                    }
+                    if(!IsDirectory || !Descend)
+                        continue;
+                    Path.assign(Current.Path).append("/").append(Name);
+                    int WD = inotify_add_watch(FD, Path.c_str(), Quiet(Flags) | IN_ONLYDIR | IN_DONT_FOLLOW);
+                    if(WD < 0){
+                        if(errno == ENOSPC){
+                            std::lock_guard<std::mutex> Lock(Mutex);
+                            Error = ENOSPC;
+                            break;
+                        }
+                        continue;
+                    }
+                    Found.push_back(Entry{Current.WD, Name, WD, Current.Depth + 1});
+                    Discovered.push_back(Job{WD, Path, Current.Depth + 1});
+                }
+                closedir(Directory);
             }
     };
 #endif
 
-class Custos{
+// ! Bounded single-producer single-consumer queue. One thread pushes, one
+// ! thread pops, neither takes a lock, the capacity is rounded up to a power of two.
+template <class Type>
+class RingBuffer{
+    public:
+        explicit RingBuffer(std::size_t Capacity) : Mask(RoundUp(Capacity) - 1), Slots(Mask + 1){}
+
+        // ! Returns false, leaving <Value> untouched, when the queue is full
+        bool Push(Type &&Value){
+            std::size_t Current = Tail.load(std::memory_order_relaxed);
+            if(Current - Head.load(std::memory_order_acquire) > Mask)
+                return false;
+            Slots[Current & Mask] = std::move(Value);
+            Tail.store(Current + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool Pop(Type &Value){
+            std::size_t Current = Head.load(std::memory_order_relaxed);
+            if(Current == Tail.load(std::memory_order_acquire))
+                return false;
+            Value = std::move(Slots[Current & Mask]);
+            Head.store(Current + 1, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t Size() const{
+            return Tail.load(std::memory_order_acquire) - Head.load(std::memory_order_acquire);
+        }
+
+        bool Empty() const{
+            return Size() == 0;
+        }
+
+    private:
+        // ! Kept on separate cache lines, the producer and the consumer each write one
+        alignas(64) std::atomic<std::size_t> Head{0};
+        alignas(64) std::atomic<std::size_t> Tail{0};
+        alignas(64) std::size_t Mask;
+        std::vector<Type> Slots;
+
+        static std::size_t RoundUp(std::size_t Value){
+            std::size_t Result = 1;
+            while(Result < Value)
+                Result <<= 1;
+            return Result;
+        }
+};
+
+// ! Types shared by every watcher, see Custos and StaticCustos
+class CustosBase{
     public:
         enum class Event{
             FILE_CREATED,
@@ -100,29 +809,177 @@ class Custos{
             FILE_MODIFIED,
             FILE_CLOSED,
             FILE_DELETED,
+            // ! Renamed inside the watched tree, see EventInformation::OldPath
+            FILE_MOVED,
             DIRECTORY_CREATED,
             DIRECTORY_OPENED,
             DIRECTORY_MODIFIED,
             DIRECTORY_CLOSED,
-            DIRECTORY_DELETED
+            DIRECTORY_DELETED,
+            DIRECTORY_MOVED
         };
         
         struct EventInformation{
             Event Type;
             std::filesystem::path Path;
+            // ! Path before the rename for FILE_MOVED and DIRECTORY_MOVED, empty otherwise
+            std::filesystem::path OldPath;
+        };
+
+        // ! What the reader does when the queue of a worker is full
+        enum class Backpressure{
+            // ! Wait until the worker makes room, no event is lost
+            BLOCK,
+            // ! Discard the event, the inotify queue keeps being drained
+            DROP
+        };
+
+        // ! Counters of the asynchronous dispatch, safe to read from any thread
+        struct QueueStatistics{
+            std::uint64_t Enqueued;
+            std::uint64_t Dropped;
+            // ! Events the reader had to wait for because a queue was full
+            std::uint64_t Stalls;
+            // ! Events waiting in the queues right now
+            std::size_t Depth;
         };
 
-        Custos(){}
+        // ! Number of values of Event, used to index per event tables
+        static constexpr std::size_t EventCount = static_cast<std::size_t>(Event::DIRECTORY_MOVED) + 1;
+
+        typedef std::function<void(const EventInformation &)> Callback;
+
+        // ! Buckets of Metrics::CallbackLatency: bucket 0 counts callbacks that took
+        // ! less than 1 microsecond, bucket N the ones that took between 2^(N-1) and
+        // ! 2^N microseconds, the last one everything slower.
+        static constexpr std::size_t LatencyBuckets = 24;
+
+        // ! Snapshot of the counters of a watcher, see GetMetrics()
+        struct Metrics{
+            // ! Seconds since Open()
+            double Seconds;
+            // ! Events reported, indexed by Event
+            std::array<std::uint64_t, EventCount> Events;
+            std::uint64_t Reads;
+            std::uint64_t BytesRead;
+            // ! Raw inotify events decoded, including the filtered ones
+            std::uint64_t InotifyEvents;
+            // ! Reads that filled the buffer, more events were probably waiting
+            std::uint64_t BufferFull;
+            std::uint64_t Overflows;
+            // ! Directories being watched right now
+            std::uint64_t Watches;
+            // ! Directories that appeared after Open() and could not be watched (or
+            // ! only partly) because /proc/sys/fs/inotify/max_user_watches was reached
+            std::uint64_t WatchLimitReached;
+            std::array<std::uint64_t, LatencyBuckets> CallbackLatency;
 
-        Custos(const std::string &Directory){
+            // ! Average events per second of <Type> since Open()
+            double Rate(Event Type) const{
+                return Seconds > 0 ? Events[static_cast<std::size_t>(Type)] / Seconds : 0;
+            }
+
+            double EventsPerRead() const{
+                return Reads ? static_cast<double>(InotifyEvents) / Reads : 0;
+            }
+
+            double BytesPerRead() const{
+                return Reads ? static_cast<double>(BytesRead) / Reads : 0;
+            }
+        };
+};
+
+// ! Callbacks registered at runtime, a slot per Event holding any number of
+// ! handlers, executed in registration order.
+class CallbackTable{
+    public:
+        void Add(CustosBase::Event Type, const CustosBase::Callback &Action){
+            Slots[Index(Type)].push_back(Action);
+        }
+
+        void Clear(CustosBase::Event Type){
+            Slots[Index(Type)].clear();
+        }
+
+        bool Registered(CustosBase::Event Type) const{
+            return !Slots[Index(Type)].empty();
+        }
+
+        void Invoke(const CustosBase::EventInformation &Information) const{
+            for(auto &Action : Slots[Index(Information.Type)])
+                Action(Information);
+        }
+
+    private:
+        std::array<std::vector<CustosBase::Callback>, CustosBase::EventCount> Slots;
+
+        static std::size_t Index(CustosBase::Event Type){
+            return static_cast<std::size_t>(Type);
+        }
+};
+
+// ! Handler bound at compile time to the event <EventType>, see Custos::On<>()
+template <CustosBase::Event EventType, class Function>
+struct Handler{
+    static constexpr CustosBase::Event Type = EventType;
+    Function Action;
+};
+
+// ! Callbacks known at compile time, each event is checked against the type
+// ! of every Handler and the matching ones are called directly, so they can
+// ! be inlined instead of going through a std::function.
+template <class... Handlers>
+class StaticCallbackTable{
+    public:
+        explicit StaticCallbackTable(Handlers... Bound) : Bound(std::move(Bound)...){}
+
+        static constexpr bool Registered(CustosBase::Event Type){
+            return (false || ... || (Handlers::Type == Type));
+        }
+
+        void Invoke(const CustosBase::EventInformation &Information){
+            std::apply([&Information](auto &... Element){
+                (Call(Element, Information), ...);
+            }, Bound);
+        }
+
+    private:
+        std::tuple<Handlers...> Bound;
+
+        template <class Element>
+        static void Call(Element &Bound, const CustosBase::EventInformation &Information){
+            if(Element::Type == Information.Type)
+                Bound.Action(Information);
+        }
+};
+
+// ! The watcher itself, <Table> is where its callbacks live: a CallbackTable
+// ! for Custos, a StaticCallbackTable for StaticCustos.
+template <class Table>
+class BasicCustos : public CustosBase{
+    public:
+        BasicCustos(){}
+
+        BasicCustos(const std::string &Directory){
             AppendToPath(Directory);
         }
 
         template <class ... Arguments>
-        Custos(Arguments... Args){
+        BasicCustos(Arguments... Args){
             AppendToPath(Args...);
         }
 
+        BasicCustos(std::in_place_t, Table &&Callbacks) : Callbacks(std::move(Callbacks)){}
+
+        ~BasicCustos(){
+            #ifdef __linux__
+            Close();
+            if(WakeFD >= 0)
+                close(WakeFD);
+            #endif
+            StopWorkers();
+        }
+
         void AppendToPath(const std::string &Path){
             Paths.push_back(Expand(std::filesystem::path(Path)));
             if(Path.length() == 0)
@@ -135,139 +992,491 @@ class Custos{
             AppendToPath(Tail...);
         }
 
-        void On(const Event &Event, const std::function<void(const EventInformation &)> &Action){
-            Callbacks[Event] = Action;
+        // ! Callback executed once every watch has been added, right before the
+        // ! watcher starts waiting for events, receives the number of watched directories.
+        void OnReady(const std::function<void(std::size_t)> &Action){
+            ReadyCallback = Action;
         }
 
-        void On(const std::vector<Event> &Events, const std::function<void(const EventInformation &)> &Action){
-            for(auto &Event : Events)
-                Callbacks[Event] = Action;
+        // ! Callback executed with every event decoded from a single read of the
+        // ! inotify queue, or with every event that survived the debounce window
+        // ! when SetDebounce() is used. Callbacks registered with On() still run,
+        // ! right before the batch callback.
+        void OnBatch(const std::function<void(const std::vector<EventInformation> &)> &Action){
+            BatchCallback = Action;
+        }
+
+        // ! Hold events for <Window> before delivering them, merging repeated
+        // ! modify, open and close events on the same path and dropping files or
+        // ! directories that were created and deleted within the window. A window
+        // ! of zero (the default) delivers events as soon as they are read.
+        void SetDebounce(std::chrono::milliseconds Window){
+            DebounceWindow = Window;
+        }
+
+        // ! Run the callbacks on a pool of <Workers> threads instead of the thread
+        // ! that called Start(), which then only reads and decodes events. Each
+        // ! worker has its own lock-free queue of <QueueCapacity> events, events
+        // ! on the same path always go to the same worker so they keep their
+        // ! order. Batch callbacks receive the events a worker drained in one go.
+        // ! Zero workers (the default) runs the callbacks inline.
+        void SetAsync(unsigned int Workers, std::size_t QueueCapacity = 4096, Backpressure Policy = Backpressure::BLOCK){
+            AsyncWorkers = Workers;
+            AsyncQueueCapacity = std::max<std::size_t>(QueueCapacity, 1);
+            AsyncPolicy = Policy;
+        }
+
+        QueueStatistics GetQueueStatistics() const{
+            QueueStatistics Statistics{
+                Enqueued.load(std::memory_order_relaxed),
+                Dropped.load(std::memory_order_relaxed),
+                Stalls.load(std::memory_order_relaxed),
+                0
+            };
+            std::lock_guard<std::mutex> Lock(WorkersMutex);
+            for(auto &Element : Workers)
+                Statistics.Depth += Element->Queue.Size();
+            return Statistics;
+        }
+
+        // ! Counters of this watcher, cheap to keep and safe to read from any thread
+        Metrics GetMetrics() const{
+            Metrics Result;
+            auto Opened = Counters.Opened.load(std::memory_order_relaxed);
+            Result.Seconds = Opened ? std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch() -
+                std::chrono::steady_clock::duration(Opened)).count() : 0;
+            for(std::size_t Index = 0; Index < EventCount; Index++)
+                Result.Events[Index] = Counters.Events[Index].load(std::memory_order_relaxed);
+            Result.Reads = Counters.Reads.load(std::memory_order_relaxed);
+            Result.BytesRead = Counters.BytesRead.load(std::memory_order_relaxed);
+            Result.InotifyEvents = Counters.InotifyEvents.load(std::memory_order_relaxed);
+            Result.BufferFull = Counters.BufferFull.load(std::memory_order_relaxed);
+            Result.Overflows = Counters.Overflows.load(std::memory_order_relaxed);
+            Result.Watches = Counters.Watches.load(std::memory_order_relaxed);
+            Result.WatchLimitReached = Counters.WatchLimitReached.load(std::memory_order_relaxed);
+            for(std::size_t Index = 0; Index < LatencyBuckets; Index++)
+                Result.CallbackLatency[Index] = Counters.CallbackLatency[Index].load(std::memory_order_relaxed);
+            return Result;
         }
 
         #ifdef __linux__
-        void Stop(){
-            Run = false;
+        // ! Size in bytes of the buffer each read() of the inotify fd fills, if
+        // ! Metrics::BufferFull keeps growing a bigger buffer drains the kernel
+        // ! queue with fewer system calls. Takes effect on the next Open().
+        void SetBufferSize(std::size_t Bytes){
+            BufferSize = Bytes;
         }
 
-        void Start(){
-            Watch Watch;
-            fd_set WatchSet;
-            char Buffer[EVENT_BUFFER_LENGTH];
-            std::string CurrentDirectory, NewDirectory;
-            int TotalFileEvents = 0;
-            int TotalDirectoryEvents = 0;
-            Event CurrentEvent;
-            // ! Call SigCallback if user hits ctrl-c
-            signal(SIGINT, SigCallback);
-            #ifdef IN_NONBLOCK
-                int FD = inotify_init1(IN_NONBLOCK);
-            #else 
-                int FD = inotify_init();
-            #endif
+        // ! Ignore entries whose name matches <Pattern>: excluded directories are
+        // ! never watched, excluded files never reported. Patterns are globs matched
+        // ! against the name of the entry, a trailing '/' only matches directories,
+        // ! for example Exclude({".git/", "node_modules/", "*.o"}).
+        void Exclude(const std::string &Pattern){
+            Filters.Add(Pattern, false);
+        }
+
+        void Exclude(std::initializer_list<std::string> Patterns){
+            for(auto &Pattern : Patterns)
+                Filters.Add(Pattern, false);
+        }
+
+        // ! Only report entries whose name matches one of the include patterns,
+        // ! file patterns do not stop directories from being watched.
+        void Include(const std::string &Pattern){
+            Filters.Add(Pattern, true);
+        }
+
+        void Include(std::initializer_list<std::string> Patterns){
+            for(auto &Pattern : Patterns)
+                Filters.Add(Pattern, true);
+        }
+        #endif
+
+        // ! When enabled, a snapshot with the inode, modification time and size of
+        // ! every entry of the watched directories is kept in memory. If the kernel
+        // ! queue overflows, the directories that changed are listed again and the
+        // ! missed creations, deletions and modifications are emitted as events,
+        // ! instead of throwing. Costs one stat per event.
+        void SetRecovery(bool Enabled){
+            Recovery = Enabled;
+        }
+
+        // ! When enabled, every directory that already exists below the listened
+        // ! paths is watched too, not only the ones created after Start(). The
+        // ! existing tree is walked with <Threads> threads, 0 means one per core.
+        void SetRecursive(bool Enabled, unsigned int Threads = 0){
+            Recursive = Enabled;
+            ScanThreads = Threads;
+        }
+
+        #ifdef __linux__
+        // ! Initialize inotify and add every watch, without waiting for events.
+        // ! Start() and Poll() call it when needed, call it yourself to register
+        // ! GetFD() in your own event loop.
+        void Open(){
+            if(FD >= 0)
+                return;
+            FD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
             // ! Checking for error
             if(FD < 0)
                 throw std::runtime_error("inotify_init failed.");
-            // ! Use select watch list for non-blocking inotify read
-            FD_ZERO(&WatchSet);
-            FD_SET(FD, &WatchSet);
-            int WD;
+            if(WakeFD < 0){
+                close(FD);
+                FD = -1;
+                throw std::runtime_error("eventfd failed.");
+            }
+            // ! At least one event with the longest possible name has to fit
+            Buffer.resize(std::max<std::size_t>(BufferSize, EVENT_SIZE + NAME_MAX + 1));
+            Counters.Opened.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+            // ! Only subscribe to what the registered callbacks need
+            Mask = WatchMask();
+            BufferOffset = BufferLength = 0;
+            std::vector<std::pair<int, std::string>> Roots;
+            bool LimitReached = false;
             for(auto &Path : Paths){
                 auto PathString = Path.string();
                 const char* Root = PathString.c_str();
-                WD = inotify_add_watch(FD, Root, WATCH_FLAGS);
+                // ! Kept quiet until the walk below is over, see DirectoryScanner::Quiet()
+                int WD = inotify_add_watch(FD, Root, (Recursive || Recovery) ? DirectoryScanner::Quiet(Mask) : Mask);
+                if(WD < 0 && errno == ENOSPC)
+                    LimitReached = true;
                 // ! Add WD and directory name to Watch map
-                Watch.Insert(-1, Root, WD);
-            }
-
-            // ! Continue until Run == false, see signal and SigCallback above
-            while(Run){
-                select(FD + 1, &WatchSet, NULL, NULL, NULL);
-                // ! Read events from non-blocking inotify fd
-                int Length = read(FD, Buffer, EVENT_BUFFER_LENGTH);
-                if(Run && Length < 0)
-                    throw std::runtime_error("Failed to read event(s) from <inotify fd>.");
-                // ! Loop through event buffer
-                for(int Iterator = 0; Iterator < Length;){
-                    struct inotify_event *Event = (struct inotify_event *) &Buffer[Iterator];
-                    // ! Never actually seen this
-                    if(Event->wd == -1)
-                        throw std::runtime_error("<inotify IN_Q_OVERFLOW> Event queue overflowed.");
-                    // ! Never seen this either
-                    if(Event->mask & IN_Q_OVERFLOW)
-                        throw std::runtime_error("<inotify IN_Q_OVERFLOW> Event queue overflowed.");
-                    if(Event->len){
-                        if(Event->mask & IN_IGNORED)
-                            // ! Watch was removed explicitly(inotify_rm_watch) or automatically
-                            // ! (file was deleted, or filesystem was unmounted)
-                            throw std::runtime_error(
-                                "<inotify IN_IGNORED> Watch was removed explicitly "
-                                "(inotify_rm_watch) or automatically (file was deleted, or "
-                                "filesystem was unmounted)"
-                            );
-                        if(Event->mask & IN_CREATE){
-                            CurrentDirectory = Watch.Get(Event->wd);
-                            if(Event->mask & IN_ISDIR){
-                                NewDirectory = CurrentDirectory + "/" + Event->name;
-                                WD = inotify_add_watch(FD, NewDirectory.c_str(), WATCH_FLAGS);
-                                Watch.Insert(Event->wd, Event->name, WD);
-                                TotalDirectoryEvents++;
-                                RunCallback(Event::DIRECTORY_CREATED, CurrentDirectory, Event->name);
-                            }else{
-                                TotalFileEvents++;
-                                RunCallback(Event::FILE_CREATED, CurrentDirectory, Event->name);
-                            }
-                        }else if(Event->mask & IN_MODIFY){
-                            if(Event->mask & IN_ISDIR)
-                                RunCallback(Event::DIRECTORY_MODIFIED, CurrentDirectory, Event->name);
-                            else
-                                RunCallback(Event::FILE_MODIFIED, CurrentDirectory, Event->name);
-                        }else if(Event->mask & IN_DELETE){
-                            if(Event->mask & IN_ISDIR){
-                                // ! Directory was deleted
-                                NewDirectory = Watch.Erase(Event->wd, Event->name, &WD);
-                                inotify_rm_watch(FD, WD);
-                                TotalDirectoryEvents--;
-                                RunCallback(Event::DIRECTORY_DELETED, CurrentDirectory, Event->name);
-                            }else{
-                                // ! File was deleted
-                                CurrentDirectory = Watch.Get(Event->wd);
-                                TotalFileEvents--;
-                                RunCallback(Event::FILE_DELETED, CurrentDirectory, Event->name);
-                            }
-                        }else if(Event->mask & IN_OPEN){
-                            CurrentDirectory = Watch.Get(Event->wd);
-                            if(Event->mask & IN_ISDIR){
-                                // ! Directory was opened
-                                RunCallback(Event::DIRECTORY_OPENED, CurrentDirectory, Event->name);
-                            }else{
-                                // ! File was openeded
-                                RunCallback(Event::FILE_OPENED, CurrentDirectory, Event->name);
-                            }
-                        }else if(Event->mask & IN_CLOSE){
-                            CurrentDirectory = Watch.Get(Event->wd);
-                            if(Event->mask & IN_ISDIR){
-                                // ! Directory was closed
-                                RunCallback(Event::DIRECTORY_CLOSED, CurrentDirectory, Event->name);
-                            }else{
-                                // ! File was closed
-                                RunCallback(Event::FILE_CLOSED, CurrentDirectory, Event->name);
-                            }
-                        }
+                Watches.Insert(-1, Root, WD);
+                Roots.emplace_back(WD, PathString);
+            }
+            if((Recursive || Recovery) && !ScanDirectories(Roots, ScanThreads))
+                LimitReached = true;
+            // ! Only here, a directory that cannot be watched later is counted in Metrics::WatchLimitReached
+            if(LimitReached)
+                throw std::runtime_error(
+                    "<inotify_add_watch> Watch limit reached, raise "
+                    "/proc/sys/fs/inotify/max_user_watches.");
+            Counters.Watches.store(Watches.Size(), std::memory_order_relaxed);
+            if(ReadyCallback)
+                ReadyCallback(Watches.Size());
+            StartWorkers();
+        }
+
+        // ! Deliver pending events, stop the workers and release every watch
+        void Close(){
+            if(FD < 0)
+                return;
+            // ! A move still waiting for its other half left the tree
+            if(MovePending)
+                MovedOut();
+            // ! Deliver whatever is still waiting in the debounce window
+            Flush(true);
+            StopWorkers();
+            close(FD);
+            FD = -1;
+            // ! WakeFD stays open, Stop() may be writing to it from another thread,
+            // ! a wake up left in it is dropped so the next Poll() does not see it
+            uint64_t Value;
+            ssize_t Ignored = read(WakeFD, &Value, sizeof(Value));
+            (void) Ignored;
+            Watches = Watch();
+            State = Snapshot();
+            Stopped.store(false);
+        }
+
+        // ! The inotify file descriptor, readable when events are available. Add it
+        // ! to your epoll/poll/select loop and call ProcessAvailable() when it is.
+        int GetFD() const{
+            return FD;
+        }
+
+        // ! Milliseconds until ProcessAvailable() has to be called again even if
+        // ! GetFD() is not readable: 0 when a previous call left events in the
+        // ! buffer, the end of the debounce window of pending events or of the
+        // ! wait for the second half of a move, or -1.
+        int GetTimeout() const{
+            if(BufferOffset < BufferLength)
+                return 0;
+            int Timeout = Coalesced.Empty() ? -1 : Until(Coalesced.Since() + DebounceWindow);
+            if(MovePending){
+                int Move = Until(Moved.Since + MoveWindow);
+                Timeout = Timeout < 0 ? Move : std::min(Timeout, Move);
+            }
+            return Timeout;
+        }
+
+        // ! Process up to <MaxEvents> inotify events that are already available,
+        // ! never blocks. Events left in the buffer are processed on the next call.
+        // ! Returns the number of inotify events processed.
+        std::size_t ProcessAvailable(std::size_t MaxEvents = SIZE_MAX){
+            Open();
+            std::size_t Processed = 0;
+            while(Processed < MaxEvents){
+                if(BufferOffset >= BufferLength){
+                    // ! Everything decoded from the previous read is delivered as one batch
+                    Flush(false);
+                    // ! Read events from non-blocking inotify fd
+                    ssize_t Length = read(FD, Buffer.data(), Buffer.size());
+                    if(Length <= 0){
+                        if(Length < 0 && errno != EAGAIN && errno != EINTR)
+                            throw std::runtime_error("Failed to read event(s) from <inotify fd>.");
+                        break;
                     }
-                    Iterator += EVENT_SIZE + Event->len;
+                    BufferOffset = 0;
+                    BufferLength = Length;
+                    Increment(Counters.Reads);
+                    Increment(Counters.BytesRead, Length);
+                    if(BufferLength + EVENT_SIZE + NAME_MAX + 1 > Buffer.size())
+                        Increment(Counters.BufferFull);
                 }
+                const struct inotify_event *Event = (const struct inotify_event *) &Buffer[BufferOffset];
+                BufferOffset += EVENT_SIZE + Event->len;
+                Process(Event);
+                Processed++;
+            }
+            // ! Nothing paired with the last IN_MOVED_FROM in time, it left the tree
+            if(MovePending && BufferOffset >= BufferLength && std::chrono::steady_clock::now() >= Moved.Since + MoveWindow)
+                MovedOut();
+            // ! No path views are held past this point
+            Watches.Compact();
+            Increment(Counters.InotifyEvents, Processed);
+            Counters.Watches.store(Watches.Size(), std::memory_order_relaxed);
+            Flush(false);
+            return Processed;
+        }
+
+        // ! Wait up to <Timeout> milliseconds (-1 waits forever) for events or
+        // ! for Stop(), then process what is available. Returns false once the
+        // ! watcher has been stopped.
+        bool Poll(int Timeout = -1){
+            Open();
+            if(Stopped.load())
+                return false;
+            int Pending = GetTimeout();
+            if(Pending >= 0 && (Timeout < 0 || Pending < Timeout))
+                Timeout = Pending;
+            struct pollfd Descriptors[2] = {{FD, POLLIN, 0}, {WakeFD, POLLIN, 0}};
+            if(poll(Descriptors, 2, Timeout) < 0 && errno != EINTR)
+                throw std::runtime_error("Failed to poll <inotify fd>.");
+            if(Descriptors[1].revents & POLLIN){
+                uint64_t Value;
+                ssize_t Ignored = read(WakeFD, &Value, sizeof(Value));
+                (void) Ignored;
             }
+            if(Stopped.load())
+                return false;
+            ProcessAvailable();
+            return true;
+        }
+
+        // ! Make Start() return, or Poll() return false. Only affects this
+        // ! instance and can be called from any thread, including a callback.
+        void Stop(){
+            Stopped.store(true);
+            uint64_t Value = 1;
+            ssize_t Ignored = write(WakeFD, &Value, sizeof(Value));
+            (void) Ignored;
+        }
 
-            // ! Exit when Run = false or user press ctrl-c
-            exit(0);
+        // ! Watch and deliver events on the calling thread until Stop() is called
+        void Start(){
+            Open();
+            try{
+                while(Poll(-1));
+            }catch(...){
+                Close();
+                throw;
+            }
+            Close();
         }
     #endif
 
+    protected:
+        // ! Callback functions based on file status
+        Table Callbacks;
+
     private:
+        // ! Collects events during the debounce window, repeated modify, open and
+        // ! close events on a path are merged into the first one, and a path that
+        // ! is created and then deleted disappears along with all its events.
+        class Coalescer{
+            public:
+                void Push(EventInformation &&Information){
+                    if(Pending.empty())
+                        First = std::chrono::steady_clock::now();
+                    if(Information.Type == Event::FILE_MOVED || Information.Type == Event::DIRECTORY_MOVED){
+                        // ! Neither path can be merged with what came before the move
+                        States.erase(Information.OldPath.native());
+                        States.erase(Information.Path.native());
+                        Append(std::move(Information));
+                        return;
+                    }
+                    int Slot = RepeatSlot(Information.Type);
+                    if(Slot < 0 && !IsCreation(Information.Type) && !IsDeletion(Information.Type)){
+                        Append(std::move(Information));
+                        return;
+                    }
+                    auto Iterator = States.try_emplace(Information.Path.native()).first;
+                    PathState &State = Iterator->second;
+                    if(Slot >= 0){
+                        if(State.Repeated[Slot] >= 0)
+                            return;
+                        State.Repeated[Slot] = Pending.size();
+                        State.Indexes.push_back(Pending.size());
+                    }else if(IsCreation(Information.Type)){
+                        State = PathState();
+                        State.Created = true;
+                        State.Indexes.push_back(Pending.size());
+                    }else{
+                        if(State.Created){
+                            // ! Created and deleted within the window, nothing happened
+                            for(auto Index : State.Indexes)
+                                Dropped[Index] = true;
+                            States.erase(Iterator);
+                            return;
+                        }
+                        // ! Whatever comes after a deletion is not a repetition
+                        State = PathState();
+                    }
+                    Append(std::move(Information));
+                }
+
+                bool Empty() const{
+                    return Pending.empty();
+                }
+
+                // ! Arrival time of the oldest pending event
+                std::chrono::steady_clock::time_point Since() const{
+                    return First;
+                }
+
+                // ! Move the surviving events, in arrival order, to the end of <Events>
+                void Take(std::vector<EventInformation> &Events){
+                    for(std::size_t Index = 0; Index < Pending.size(); Index++)
+                        if(!Dropped[Index])
+                            Events.push_back(std::move(Pending[Index]));
+                    Pending.clear();
+                    Dropped.clear();
+                    States.clear();
+                }
+
+            private:
+                struct PathState{
+                    bool Created = false;
+                    // ! Index of the pending modify, open and close events of the path
+                    long Repeated[3] = {-1, -1, -1};
+                    std::vector<std::size_t> Indexes;
+                };
+                std::vector<EventInformation> Pending;
+                std::vector<bool> Dropped;
+                std::unordered_map<std::string, PathState> States;
+                std::chrono::steady_clock::time_point First;
+
+                void Append(EventInformation &&Information){
+                    Pending.push_back(std::move(Information));
+                    Dropped.push_back(false);
+                }
+
+                static int RepeatSlot(Event Type){
+                    switch(Type){
+                        case Event::FILE_MODIFIED: case Event::DIRECTORY_MODIFIED: return 0;
+                        case Event::FILE_OPENED: case Event::DIRECTORY_OPENED: return 1;
+                        case Event::FILE_CLOSED: case Event::DIRECTORY_CLOSED: return 2;
+                        default: return -1;
+                    }
+                }
+
+                static bool IsCreation(Event Type){
+                    return Type == Event::FILE_CREATED || Type == Event::DIRECTORY_CREATED;
+                }
+
+                static bool IsDeletion(Event Type){
+                    return Type == Event::FILE_DELETED || Type == Event::DIRECTORY_DELETED;
+                }
+        };
+
         // ! Root directory of the file watcher
         std::vector<std::filesystem::path> Paths;
-        // ! Callback functions based on file status
-        std::map<Event, std::function<void(const EventInformation &)>> Callbacks;
+        std::function<void(std::size_t)> ReadyCallback;
+        std::function<void(const std::vector<EventInformation> &)> BatchCallback;
+        // ! Events decoded from the current read, only used when batching
+        std::vector<EventInformation> Batch;
+        std::chrono::milliseconds DebounceWindow{0};
+        Coalescer Coalesced;
+
+        // ! Asynchronous dispatch, see SetAsync()
+        struct Worker{
+            explicit Worker(std::size_t Capacity) : Queue(Capacity){}
+            RingBuffer<EventInformation> Queue;
+            std::thread Thread;
+            std::mutex Mutex;
+            std::condition_variable Condition;
+            std::atomic<bool> Sleeping{false};
+            // ! Signalled by the worker after it pops while the reader waits for room,
+            // ! see Backpressure::BLOCK
+            std::condition_variable Space;
+            std::atomic<bool> Full{false};
+        };
+        unsigned int AsyncWorkers = 0;
+        std::size_t AsyncQueueCapacity = 4096;
+        Backpressure AsyncPolicy = Backpressure::BLOCK;
+        std::vector<std::unique_ptr<Worker>> Workers;
+        mutable std::mutex WorkersMutex;
+        std::atomic<bool> WorkersRunning{false};
+        std::atomic<std::uint64_t> Enqueued{0};
+        std::atomic<std::uint64_t> Dropped{0};
+        std::atomic<std::uint64_t> Stalls{0};
+        // ! Watch subdirectories that already exist when Start() is called
+        bool Recursive = false;
+        unsigned int ScanThreads = 0;
+        // ! Rescan instead of throwing when the kernel queue overflows, see SetRecovery()
+        bool Recovery = false;
+        #ifdef __linux__
+        Snapshot State;
+        #endif
+        // ! Reused to build paths that are only needed for a system call
+        std::string Scratch;
+        // ! Backing storage of GetMetrics()
+        struct MetricCounters{
+            std::array<std::atomic<std::uint64_t>, EventCount> Events{};
+            std::atomic<std::uint64_t> Reads{0};
+            std::atomic<std::uint64_t> BytesRead{0};
+            std::atomic<std::uint64_t> InotifyEvents{0};
+            std::atomic<std::uint64_t> BufferFull{0};
+            std::atomic<std::uint64_t> Overflows{0};
+            std::atomic<std::uint64_t> Watches{0};
+            std::atomic<std::uint64_t> WatchLimitReached{0};
+            std::array<std::atomic<std::uint64_t>, LatencyBuckets> CallbackLatency{};
+            // ! steady_clock ticks at Open(), 0 before
+            std::atomic<std::int64_t> Opened{0};
+        };
+        MetricCounters Counters;
+        #ifdef __linux__
+        Filter Filters;
+        std::size_t BufferSize = EVENT_BUFFER_LENGTH;
+        // ! inotify events subscribed to, computed by Open()
+        uint32_t Mask = WATCH_FLAGS;
+        int FD = -1;
+        // ! Written by Stop() to wake up Poll(), from any thread. Created along with
+        // ! the watcher and only closed by its destructor, so it never changes
+        // ! while Stop() may be using it.
+        const int WakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        std::atomic<bool> Stopped{false};
+        Watch Watches;
+        // ! IN_MOVED_FROM waiting for the IN_MOVED_TO with the same cookie, the
+        // ! kernel queues both back to back when the destination is watched
+        struct Move{
+            uint32_t Cookie = 0;
+            int PD = -1;
+            bool IsDirectory = false;
+            std::string Directory;
+            std::string Name;
+            std::chrono::steady_clock::time_point Since;
+        };
+        Move Moved;
+        bool MovePending = false;
+        // ! How long an IN_MOVED_FROM at the end of the queue waits for its pair
+        static constexpr std::chrono::milliseconds MoveWindow{10};
+        // ! Events read from the inotify fd, [BufferOffset, BufferLength) is not processed yet
+        std::vector<char> Buffer;
+        std::size_t BufferOffset = 0;
+        std::size_t BufferLength = 0;
+        #endif
         std::filesystem::path Expand(std::filesystem::path Input){
             const char* Home = getenv("HOME");
             if(!Home)
@@ -280,12 +1489,594 @@ class Custos{
             return Input;
         }
 
-        bool IsCallbackRegistered(const Event &Event){
-            return (Callbacks.find(Event) != Callbacks.end());
+        bool IsCallbackRegistered(const Event &Event) const{
+            return Callbacks.Registered(Event);
+        }
+
+        // ! Whether events are collected before running the callbacks
+        bool IsBatching() const{
+            return BatchCallback || DebounceWindow.count() > 0 || AsyncWorkers > 0;
+        }
+
+        // ! <OldDirectory> and <OldFilename> are where a moved entry came from
+        void RunCallback(const Event &Event, std::string_view CurrentDirectory, std::string_view Filename,
+                std::string_view OldDirectory = std::string_view(), std::string_view OldFilename = std::string_view()){
+            Increment(Counters.Events[static_cast<std::size_t>(Event)]);
+            bool Batching = IsBatching();
+            if(!Batching && !IsCallbackRegistered(Event))
+                return;
+            // ! The only allocation of the event, the string is moved into the path
+            std::string Path;
+            Path.reserve(CurrentDirectory.size() + 1 + Filename.size());
+            Path.append(CurrentDirectory).append("/").append(Filename);
+            EventInformation Information{Event, std::filesystem::path(std::move(Path)), std::filesystem::path()};
+            if(!OldFilename.empty()){
+                Path.clear();
+                Path.reserve(OldDirectory.size() + 1 + OldFilename.size());
+                Path.append(OldDirectory).append("/").append(OldFilename);
+                Information.OldPath = std::move(Path);
+            }
+            if(!Batching)
+                Invoke(Information);
+            else if(DebounceWindow.count() > 0)
+                Coalesced.Push(std::move(Information));
+            else
+                Batch.push_back(std::move(Information));
+        }
+
+        #ifdef __linux__
+        // ! RunCallback, for entries that pass the include patterns
+        void Report(const Event &Event, std::string_view CurrentDirectory, const char *Filename,
+                std::string_view OldDirectory = std::string_view(), std::string_view OldFilename = std::string_view()){
+            bool IsDirectory = Event >= Event::DIRECTORY_CREATED;
+            if(Filters.Included(Filename, IsDirectory))
+                RunCallback(Event, CurrentDirectory, Filename, OldDirectory, OldFilename);
         }
 
-        void RunCallback(const Event &Event, const std::string &CurrentDirectory, const std::string &Filename){
-            if(IsCallbackRegistered(Event))
-                Callbacks[Event](EventInformation{Event, std::filesystem::path(CurrentDirectory + "/" + Filename)});
+        // ! inotify events needed by the registered callbacks. IN_CREATE and IN_MOVE
+        // ! are always needed to keep the watched tree and its paths right, deleted
+        // ! directories are released on IN_IGNORED.
+        uint32_t WatchMask() const{
+            if(BatchCallback)
+                return WATCH_FLAGS;
+            uint32_t Result = IN_CREATE | IN_MOVE;
+            if(Recovery)
+                Result |= IN_DELETE;
+            for(std::size_t Index = 0; Index < EventCount; Index++){
+                if(!IsCallbackRegistered(static_cast<Event>(Index)))
+                    continue;
+                switch(static_cast<Event>(Index)){
+                    case Event::FILE_CREATED: case Event::DIRECTORY_CREATED: Result |= IN_CREATE; break;
+                    case Event::FILE_OPENED: case Event::DIRECTORY_OPENED: Result |= IN_OPEN; break;
+                    case Event::FILE_MODIFIED: case Event::DIRECTORY_MODIFIED: Result |= IN_MODIFY; break;
+                    case Event::FILE_CLOSED: case Event::DIRECTORY_CLOSED: Result |= IN_CLOSE; break;
+                    case Event::FILE_DELETED: case Event::DIRECTORY_DELETED: Result |= IN_DELETE; break;
+                    case Event::FILE_MOVED: case Event::DIRECTORY_MOVED: Result |= IN_MOVE; break;
+                }
+            }
+            return Result;
+        }
+        #endif
+
+        // ! Run the callbacks of an event, recording how long they took
+        void Invoke(const EventInformation &Information){
+            auto Begin = std::chrono::steady_clock::now();
+            Callbacks.Invoke(Information);
+            auto Microseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - Begin).count();
+            std::size_t Bucket = 0;
+            while(Microseconds > 0 && Bucket + 1 < LatencyBuckets){
+                Microseconds >>= 1;
+                Bucket++;
+            }
+            // ! Workers record latencies concurrently, this one needs a real atomic add
+            Counters.CallbackLatency[Bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // ! Milliseconds left until <Deadline>, rounded up since waking up before
+        // ! the deadline would only spin
+        static int Until(std::chrono::steady_clock::time_point Deadline){
+            auto Remaining = std::chrono::duration_cast<std::chrono::milliseconds>(Deadline - std::chrono::steady_clock::now()).count();
+            return static_cast<int>(std::max<long long>(Remaining + 1, 0));
+        }
+
+        // ! Counters only written by the thread reading events, a plain load and
+        // ! store is enough and cheaper than an atomic read-modify-write
+        static void Increment(std::atomic<std::uint64_t> &Counter, std::uint64_t Value = 1){
+            Counter.store(Counter.load(std::memory_order_relaxed) + Value, std::memory_order_relaxed);
+        }
+
+        // ! Deliver the events collected so far, coalesced events are only
+        // ! delivered once their window is over, unless <Force> is set.
+        void Flush(bool Force){
+            if(!Coalesced.Empty() && (Force || std::chrono::steady_clock::now() >= Coalesced.Since() + DebounceWindow))
+                Coalesced.Take(Batch);
+            if(Batch.empty())
+                return;
+            if(!Workers.empty()){
+                for(auto &Information : Batch)
+                    Enqueue(std::move(Information));
+            }else{
+                Deliver(Batch);
+            }
+            Batch.clear();
+        }
+
+        void Deliver(const std::vector<EventInformation> &Events){
+            for(auto &Information : Events)
+                if(IsCallbackRegistered(Information.Type))
+                    Invoke(Information);
+            if(BatchCallback)
+                BatchCallback(Events);
+        }
+
+        void StartWorkers(){
+            if(AsyncWorkers == 0 || !Workers.empty())
+                return;
+            std::lock_guard<std::mutex> Lock(WorkersMutex);
+            WorkersRunning.store(true);
+            for(unsigned int Iterator = 0; Iterator < AsyncWorkers; Iterator++)
+                Workers.push_back(std::make_unique<Worker>(AsyncQueueCapacity));
+            for(auto &Element : Workers)
+                Element->Thread = std::thread(&BasicCustos::Work, this, std::ref(*Element));
+        }
+
+        // ! Workers drain what is left in their queues before exiting
+        void StopWorkers(){
+            if(Workers.empty())
+                return;
+            WorkersRunning.store(false);
+            for(auto &Element : Workers){
+                Wake(*Element);
+                Element->Thread.join();
+            }
+            std::lock_guard<std::mutex> Lock(WorkersMutex);
+            Workers.clear();
+        }
+
+        void Wake(Worker &Target){
+            std::lock_guard<std::mutex> Lock(Target.Mutex);
+            Target.Condition.notify_one();
+        }
+
+        void Enqueue(EventInformation &&Information){
+            std::size_t Index = Workers.size() == 1 ? 0 : std::hash<std::string>()(Information.Path.native()) % Workers.size();
+            Worker &Target = *Workers[Index];
+            if(!Target.Queue.Push(std::move(Information))){
+                if(AsyncPolicy == Backpressure::DROP){
+                    Dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                Stalls.fetch_add(1, std::memory_order_relaxed);
+                // ! Full is published before the queue is checked again, and the worker
+                // ! checks Full after popping, so the signal is never missed
+                std::unique_lock<std::mutex> Lock(Target.Mutex);
+                Target.Full.store(true);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                while(!Target.Queue.Push(std::move(Information))){
+                    Target.Condition.notify_one();
+                    Target.Space.wait_for(Lock, std::chrono::milliseconds(100));
+                }
+                Target.Full.store(false);
+            }
+            Enqueued.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(Target.Sleeping.load())
+                Wake(Target);
+        }
+
+        void Work(Worker &Self){
+            std::vector<EventInformation> Drained;
+            EventInformation Information;
+            for(;;){
+                while(Drained.size() < 1024 && Self.Queue.Pop(Information))
+                    Drained.push_back(std::move(Information));
+                if(!Drained.empty()){
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if(Self.Full.load()){
+                        std::lock_guard<std::mutex> Lock(Self.Mutex);
+                        Self.Space.notify_one();
+                    }
+                    Deliver(Drained);
+                    Drained.clear();
+                    continue;
+                }
+                // ! The pop above may have missed what was pushed right before stopping
+                // ! (Close() flushes the debounce window), leave only once it is empty
+                if(!WorkersRunning.load()){
+                    if(Self.Queue.Empty())
+                        return;
+                    continue;
+                }
+                // ! Sleeping is published before the queue is checked again, and the
+                // ! reader checks Sleeping after pushing, so a wake up is never missed
+                std::unique_lock<std::mutex> Lock(Self.Mutex);
+                Self.Sleeping.store(true);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(Self.Queue.Empty() && WorkersRunning.load())
+                    Self.Condition.wait_for(Lock, std::chrono::milliseconds(100));
+                Self.Sleeping.store(false);
+            }
+        }
+
+        #ifdef __linux__
+        // ! Decode one inotify event and run the matching callbacks
+        void Process(const struct inotify_event *Event){
+            int WD;
+            // ! A pending IN_MOVED_FROM only pairs with the event right after it
+            if(MovePending && (!(Event->mask & IN_MOVED_TO) || Event->cookie != Moved.Cookie))
+                MovedOut();
+            // ! The kernel queue overflowed and events were lost, find out what
+            // ! changed by comparing the watched directories against the snapshot
+            if(Event->wd == -1 || (Event->mask & IN_Q_OVERFLOW)){
+                Increment(Counters.Overflows);
+                if(!Recovery)
+                    throw std::runtime_error("<inotify IN_Q_OVERFLOW> Event queue overflowed.");
+                Recover();
+            }else if(Event->mask & IN_IGNORED){
+                // ! Watch was removed explicitly(inotify_rm_watch) or automatically
+                // ! (file was deleted, or filesystem was unmounted)
+                Watches.Erase(Event->wd);
+                State.Erase(Event->wd);
+            }else if(Event->len){
+                // ! Rejected by name before anything else is done with the event
+                if(Filters.Excluded(Event->name, Event->mask & IN_ISDIR))
+                    return;
+                // ! Full path of the watched directory, precomputed by the Watch table
+                std::string_view CurrentDirectory = Watches.Get(Event->wd);
+                // ! Queued before its watch was removed
+                if(CurrentDirectory.empty())
+                    return;
+                std::string_view Name(Event->name);
+                if(Recovery)
+                    Track(Event->wd, Event->mask, CurrentDirectory, Event->name);
+                if(Event->mask & IN_CREATE){
+                    if(Event->mask & IN_ISDIR){
+                        // ! Reported before its content, see WatchDirectories()
+                        Report(Event::DIRECTORY_CREATED, CurrentDirectory, Event->name);
+                        WatchDirectories({{Event->wd, std::string(Name)}});
+                    }else{
+                        Report(Event::FILE_CREATED, CurrentDirectory, Event->name);
+                    }
+                }else if(Event->mask & IN_MODIFY){
+                    if(Event->mask & IN_ISDIR)
+                        Report(Event::DIRECTORY_MODIFIED, CurrentDirectory, Event->name);
+                    else
+                        Report(Event::FILE_MODIFIED, CurrentDirectory, Event->name);
+                }else if(Event->mask & IN_DELETE){
+                    if(Event->mask & IN_ISDIR){
+                        // ! Directory was deleted
+                        Watches.Erase(Event->wd, Name, &WD);
+                        if(WD >= 0){
+                            inotify_rm_watch(FD, WD);
+                            State.Erase(WD);
+                        }
+                        Report(Event::DIRECTORY_DELETED, CurrentDirectory, Event->name);
+                    }else{
+                        // ! File was deleted
+                        Report(Event::FILE_DELETED, CurrentDirectory, Event->name);
+                    }
+                }else if(Event->mask & IN_MOVED_FROM){
+                    // ! Held until the next event tells whether it stayed in the tree
+                    Moved.Cookie = Event->cookie;
+                    Moved.PD = Event->wd;
+                    Moved.IsDirectory = Event->mask & IN_ISDIR;
+                    Moved.Directory.assign(CurrentDirectory);
+                    Moved.Name.assign(Name);
+                    Moved.Since = std::chrono::steady_clock::now();
+                    MovePending = true;
+                }else if(Event->mask & IN_MOVED_TO){
+                    // ! Without a pending IN_MOVED_FROM it came from outside the tree
+                    bool Paired = MovePending;
+                    MovePending = false;
+                    if(Event->mask & IN_ISDIR){
+                        WD = Paired ? Watches.Get(Moved.PD, Moved.Name) : -1;
+                        // ! Renamed inside the tree, the watches below it stay as they are
+                        if(WD >= 0)
+                            Watches.Rename(WD, Event->wd, Name);
+                        if(Paired)
+                            Report(Event::DIRECTORY_MOVED, CurrentDirectory, Event->name, Moved.Directory, Moved.Name);
+                        else
+                            Report(Event::DIRECTORY_CREATED, CurrentDirectory, Event->name);
+                        // ! Only the incoming subtree is walked
+                        if(WD < 0)
+                            WatchDirectories({{Event->wd, std::string(Name)}});
+                    }else{
+                        if(Paired)
+                            Report(Event::FILE_MOVED, CurrentDirectory, Event->name, Moved.Directory, Moved.Name);
+                        else
+                            Report(Event::FILE_CREATED, CurrentDirectory, Event->name);
+                    }
+                }else if(Event->mask & IN_OPEN){
+                    if(Event->mask & IN_ISDIR){
+                        // ! Directory was opened
+                        Report(Event::DIRECTORY_OPENED, CurrentDirectory, Event->name);
+                    }else{
+                        // ! File was openeded
+                        Report(Event::FILE_OPENED, CurrentDirectory, Event->name);
+                    }
+                }else if(Event->mask & IN_CLOSE){
+                    if(Event->mask & IN_ISDIR){
+                        // ! Directory was closed
+                        Report(Event::DIRECTORY_CLOSED, CurrentDirectory, Event->name);
+                    }else{
+                        // ! File was closed
+                        Report(Event::FILE_CLOSED, CurrentDirectory, Event->name);
+                    }
+                }
+            }
+        }
+
+        // ! Watch the directories that appeared inside the tree, given as their
+        // ! parent WD and name. They may already have content (mkdir -p, cp -r,
+        // ! tar, a directory moved in...) created before their watch existed, they
+        // ! are walked together with <Threads> threads and what is found inside
+        // ! is reported as created. The directories and their parents stay quiet
+        // ! during the walk, see DirectoryScanner::Quiet(). Reaching the watch limit
+        // ! here leaves a directory (or part of it) unwatched, see
+        // ! Metrics::WatchLimitReached.
+        void WatchDirectories(const std::vector<std::pair<int, std::string>> &Directories, unsigned int Threads = 1){
+            bool Walk = Recursive || Recovery;
+            std::vector<std::pair<int, std::string>> Roots;
+            std::vector<int> Parents;
+            for(auto &Element : Directories){
+                std::string_view CurrentDirectory = Watches.Get(Element.first);
+                std::string Path;
+                Path.reserve(CurrentDirectory.size() + 1 + Element.second.size());
+                Path.append(CurrentDirectory).append("/").append(Element.second);
+                int WD = inotify_add_watch(FD, Path.c_str(), Walk ? DirectoryScanner::Quiet(Mask) : Mask);
+                if(WD < 0){
+                    if(errno == ENOSPC)
+                        Increment(Counters.WatchLimitReached);
+                    continue;
+                }
+                Watches.Insert(Element.first, Element.second, WD);
+                Roots.emplace_back(WD, std::move(Path));
+                Parents.push_back(Element.first);
+            }
+            if(!Walk || Roots.empty())
+                return;
+            std::sort(Parents.begin(), Parents.end());
+            Parents.erase(std::unique(Parents.begin(), Parents.end()), Parents.end());
+            Silence(Parents, true);
+            if(!ScanDirectories(Roots, Threads, true))
+                Increment(Counters.WatchLimitReached);
+            Silence(Parents, false);
+        }
+
+        // ! Give the watches <WDs> the mask DirectoryScanner::Quiet(Mask) while
+        // ! <Enabled>, or back <Mask>, so that listing them queues nothing
+        void Silence(const std::vector<int> &WDs, bool Enabled){
+            if(DirectoryScanner::Quiet(Mask) == Mask)
+                return;
+            for(auto WD : WDs){
+                Scratch.assign(Watches.Get(WD));
+                if(!Scratch.empty())
+                    inotify_add_watch(FD, Scratch.c_str(), Enabled ? DirectoryScanner::Quiet(Mask) : Mask);
+            }
+        }
+
+        // ! The IN_MOVED_FROM held in <Moved> had no IN_MOVED_TO, the entry left
+        // ! the watched tree and is reported as deleted. The kernel keeps watching
+        // ! a directory moved elsewhere, so its watches and the ones below it go.
+        void MovedOut(){
+            MovePending = false;
+            if(Moved.IsDirectory){
+                int WD = Watches.Get(Moved.PD, Moved.Name);
+                for(auto Element : Watches.Detach(WD)){
+                    inotify_rm_watch(FD, Element);
+                    State.Erase(Element);
+                }
+                Report(Event::DIRECTORY_DELETED, Moved.Directory, Moved.Name.c_str());
+            }else{
+                Report(Event::FILE_DELETED, Moved.Directory, Moved.Name.c_str());
+            }
+        }
+
+        // ! Walk <Roots>, watching their subdirectories in recursive mode and
+        // ! recording their snapshot when recovery is enabled. With <Announce>
+        // ! every entry found is reported as created, for directories that
+        // ! appeared while the watcher runs. Returns false if the walk stopped at
+        // ! the watch limit.
+        bool ScanDirectories(const std::vector<std::pair<int, std::string>> &Roots, unsigned int Threads, bool Announce = false){
+            DirectoryScanner Scanner(FD, Mask, Threads, Recursive, &Filters);
+            std::vector<DirectoryScanner::Listing> Listings;
+            for(auto &Element : Scanner.Scan(Roots, (Recovery || Announce) ? &Listings : nullptr))
+                Watches.Insert(Element.PD, Element.Name, Element.WD);
+            if(Announce){
+                // ! Parents first, the path of a directory is longer than its parent's
+                std::vector<std::pair<std::size_t, std::size_t>> Order;
+                for(std::size_t Index = 0; Index < Listings.size(); Index++)
+                    Order.emplace_back(Watches.Get(Listings[Index].first).size(), Index);
+                std::sort(Order.begin(), Order.end());
+                for(auto &Element : Order){
+                    auto &Listed = Listings[Element.second];
+                    std::string_view CurrentDirectory = Watches.Get(Listed.first);
+                    for(auto &Entry : Listed.second.Entries)
+                        Report(Entry.second.IsDirectory ? Event::DIRECTORY_CREATED : Event::FILE_CREATED,
+                            CurrentDirectory, Entry.first.c_str());
+                }
+            }
+            if(Recovery)
+                for(auto &Element : Listings)
+                    State.Set(Element.first, std::move(Element.second));
+            return !Scanner.LimitReached();
+        }
+
+        // ! Keep the snapshot in sync with an event received on <WD>
+        void Track(int WD, uint32_t Mask, std::string_view CurrentDirectory, std::string_view Name){
+            if(Mask & (IN_DELETE | IN_MOVED_FROM)){
+                State.Remove(WD, Name);
+            }else if(Mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE)){
+                Scratch.assign(CurrentDirectory).append("/").append(Name);
+                State.Update(WD, Scratch, Name, Mask & IN_ISDIR);
+            }
+        }
+
+        // ! Called after a queue overflow. Every watched directory is stat'ed,
+        // ! the ones that changed (entries added or removed) or received events
+        // ! since the previous recovery are listed again in parallel, and the
+        // ! differences with the snapshot are emitted as events. The entries of
+        // ! the other directories are stat'ed, without listing them, to find the
+        // ! files rewritten in place.
+        void Recover(){
+            std::vector<std::pair<int, std::string>> Targets;
+            for(auto &Element : State.All()){
+                std::string_view Path = Watches.Get(Element.first);
+                Scratch.assign(Path);
+                struct stat Status;
+                Snapshot::Directory &Directory = Element.second;
+                if(Directory.Active || stat(Scratch.c_str(), &Status) != 0 ||
+                        Status.st_ino != Directory.Inode || Snapshot::Changed(Status.st_mtim, Directory.Modified) ||
+                        !Restat(Path, Directory))
+                    Targets.emplace_back(Element.first, Scratch);
+                Directory.Active = false;
+            }
+            // ! Listing a directory queues events on its parent too, the scanner
+            // ! gives the targets their mask back, the other parents are restored here
+            std::vector<int> Quieted, Outside;
+            for(auto &Element : Targets)
+                Quieted.push_back(Element.first);
+            std::sort(Quieted.begin(), Quieted.end());
+            for(auto &Element : Targets){
+                int Parent = Watches.Parent(Element.first);
+                if(Parent >= 0 && !std::binary_search(Quieted.begin(), Quieted.end(), Parent))
+                    Outside.push_back(Parent);
+            }
+            std::sort(Outside.begin(), Outside.end());
+            Outside.erase(std::unique(Outside.begin(), Outside.end()), Outside.end());
+            Silence(Quieted, true);
+            Silence(Outside, true);
+            DirectoryScanner Scanner(FD, Mask, ScanThreads, false, &Filters);
+            std::vector<DirectoryScanner::Listing> Listings;
+            Scanner.Scan(Targets, &Listings);
+            Silence(Outside, false);
+            // ! Directories created while events were lost, walked in one go once
+            // ! every target is compared
+            std::vector<std::pair<int, std::string>> Created;
+            for(auto &Element : Listings){
+                // ! Removed by the comparison of one of its parents
+                if(!State.Find(Element.first))
+                    continue;
+                Compare(Element.first, Element.second, Created);
+                Element.second.Active = false;
+                State.Set(Element.first, std::move(Element.second));
+            }
+            WatchDirectories(Created, ScanThreads);
+        }
+
+        // ! Stat the recorded files of a directory whose entries did not change and
+        // ! report the ones modified. Returns false when a file is gone or was
+        // ! replaced, the directory then has to be listed again.
+        bool Restat(std::string_view CurrentDirectory, Snapshot::Directory &Directory){
+            if(Directory.Entries.empty())
+                return true;
+            Scratch.assign(CurrentDirectory);
+            // ! O_PATH does not open the directory for reading, nothing is queued
+            int DirectoryFD = open(Scratch.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if(DirectoryFD < 0)
+                return false;
+            bool Unchanged = true;
+            for(auto &Element : Directory.Entries){
+                if(Element.second.IsDirectory)
+                    continue;
+                Snapshot::Entry Fresh;
+                if(!Snapshot::Stat(DirectoryFD, Element.first.c_str(), Fresh) ||
+                        Fresh.Inode != Element.second.Inode || Fresh.IsDirectory){
+                    Unchanged = false;
+                    break;
+                }
+                if(Fresh.Size != Element.second.Size || Snapshot::Changed(Fresh.Modified, Element.second.Modified)){
+                    Element.second = Fresh;
+                    Report(Event::FILE_MODIFIED, CurrentDirectory, Element.first.c_str());
+                }
+            }
+            close(DirectoryFD);
+            return Unchanged;
+        }
+
+        // ! Report how the directory <WD> changed between the snapshot and <Fresh>,
+        // ! the directories created inside it are appended to <Directories>, to be
+        // ! passed to WatchDirectories()
+        void Compare(int WD, const Snapshot::Directory &Fresh, std::vector<std::pair<int, std::string>> &Directories){
+            const Snapshot::Directory &Old = *State.Find(WD);
+            std::string_view CurrentDirectory = Watches.Get(WD);
+            std::vector<std::pair<std::string, bool>> Created;
+            for(auto &Element : Old.Entries){
+                auto Iterator = Fresh.Entries.find(Element.first);
+                bool Replaced = Iterator != Fresh.Entries.end() && (Iterator->second.Inode != Element.second.Inode ||
+                    Iterator->second.IsDirectory != Element.second.IsDirectory);
+                if(Iterator == Fresh.Entries.end() || Replaced){
+                    if(Element.second.IsDirectory){
+                        // ! Everything below it goes too, the kernel keeps watching a
+                        // ! directory that was moved out of the tree
+                        for(auto ChildWD : Watches.Detach(Watches.Get(WD, Element.first))){
+                            inotify_rm_watch(FD, ChildWD);
+                            State.Erase(ChildWD);
+                        }
+                        Report(Event::DIRECTORY_DELETED, CurrentDirectory, Element.first.c_str());
+                    }else{
+                        Report(Event::FILE_DELETED, CurrentDirectory, Element.first.c_str());
+                    }
+                    if(Replaced)
+                        Created.emplace_back(Element.first, Iterator->second.IsDirectory);
+                }else if(!Element.second.IsDirectory && (Element.second.Size != Iterator->second.Size ||
+                        Snapshot::Changed(Element.second.Modified, Iterator->second.Modified))){
+                    Report(Event::FILE_MODIFIED, CurrentDirectory, Element.first.c_str());
+                }
+            }
+            for(auto &Element : Fresh.Entries)
+                if(Old.Entries.find(Element.first) == Old.Entries.end())
+                    Created.emplace_back(Element.first, Element.second.IsDirectory);
+            for(auto &Element : Created){
+                if(Element.second){
+                    Report(Event::DIRECTORY_CREATED, CurrentDirectory, Element.first.c_str());
+                    Directories.emplace_back(WD, std::move(Element.first));
+                }else{
+                    Report(Event::FILE_CREATED, CurrentDirectory, Element.first.c_str());
+                }
+            }
+        }
+        #endif
+};
+
+// ! Watcher whose callbacks are registered at runtime with On()
+class Custos : public BasicCustos<CallbackTable>{
+    public:
+        using BasicCustos::BasicCustos;
+
+        // ! Add <Action> to the callbacks of <Event>, every callback registered
+        // ! for an event runs, in the order in which they were added.
+        void On(const Event &Event, const Callback &Action){
+            Callbacks.Add(Event, Action);
+        }
+
+        void On(const std::vector<Event> &Events, const Callback &Action){
+            for(auto &Event : Events)
+                Callbacks.Add(Event, Action);
+        }
+
+        // ! Remove every callback registered for <Event>
+        void Off(const Event &Event){
+            Callbacks.Clear(Event);
+        }
+
+        // ! Bind <Action> to <Type> at compile time, for StaticCustos:
+        // ! StaticCustos Watcher(".", Custos::On<Custos::Event::FILE_CREATED>([](auto &Event){ ... }));
+        template <Event Type, class Function>
+        static Handler<Type, Function> On(Function Action){
+            return Handler<Type, Function>{std::move(Action)};
+        }
+};
+
+// ! Watcher whose callbacks are fixed at compile time, they are called
+// ! directly (and can be inlined) instead of through std::function. Its
+// ! type depends on the handlers, so it is usually declared with auto or
+// ! class template argument deduction.
+template <class... Handlers>
+class StaticCustos : public BasicCustos<StaticCallbackTable<Handlers...>>{
+    public:
+        StaticCustos(const std::string &Directory, Handlers... Bound) :
+            BasicCustos<StaticCallbackTable<Handlers...>>(std::in_place, StaticCallbackTable<Handlers...>(std::move(Bound)...)){
+            this->AppendToPath(Directory);
         }
 };
@@ -0,0 +1,67 @@
+/***
+ * Copyright (C) Rodolfo Herrera Hernandez. All rights reserved.
+ * Licensed under the MIT license. See LICENSE file in the project root 
+ * for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * For related information - https://github.com/codewithrodi/Custos/
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+
+#include <iostream>
+#include <sys/epoll.h>
+#include "Custos.hxx"
+
+int main(int argc, char* argv[]){
+    // ! Two independent watchers, both served by the same thread
+    // ! with epoll, without any extra thread.
+    auto Sources = Custos("Sources/");
+    auto Assets = Custos("Assets/");
+
+    Sources.On(Custos::Event::FILE_MODIFIED, [](auto &Event){
+        std::cout << "Source modified: " << Event.Path << std::endl;
+    });
+
+    Assets.On(Custos::Event::FILE_CREATED, [](auto &Event){
+        std::cout << "Asset created: " << Event.Path << std::endl;
+    });
+
+    try{
+        // ! Open() adds the watches and returns immediately, after it
+        // ! GetFD() can be registered in any event loop, here epoll.
+        Sources.Open();
+        Assets.Open();
+        int Loop = epoll_create1(0);
+        for(auto *Watcher : {&Sources, &Assets}){
+            struct epoll_event Registration = {};
+            Registration.events = EPOLLIN;
+            Registration.data.ptr = Watcher;
+            epoll_ctl(Loop, EPOLL_CTL_ADD, Watcher->GetFD(), &Registration);
+        }
+
+        for(;;){
+            // ! GetTimeout() tells us when a watcher needs to be called even
+            // ! without new events (pending debounce window, events left over
+            // ! by a previous call with a limit).
+            int Timeout = -1;
+            for(auto *Watcher : {&Sources, &Assets}){
+                int Pending = Watcher->GetTimeout();
+                if(Pending >= 0 && (Timeout < 0 || Pending < Timeout))
+                    Timeout = Pending;
+            }
+            struct epoll_event Ready[8];
+            epoll_wait(Loop, Ready, 8, Timeout);
+            // ! ProcessAvailable() never blocks, we can also limit how many
+            // ! events are processed so that no watcher starves the others.
+            Sources.ProcessAvailable(256);
+            Assets.ProcessAvailable(256);
+        }
+    }catch(const std::runtime_error& RuntimeError){
+        // ! If any error occurs, we will display the message in the terminal.
+        std::cout << RuntimeError.what() << std::endl;
+    }
+
+    return 0;
+}